@@ -6,6 +6,7 @@
 #include <chrono>
 #include <cstring>
 #include <climits>
+#include <deque>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -23,6 +24,10 @@
 #define USE_SSE2
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc for search deadlines
+#endif
+
 using namespace std;
 
 // ==================== Thread Local Storage ====================
@@ -58,6 +63,219 @@ struct VisitedBuffer
 
 static thread_local VisitedBuffer tls_visited;
 
+// Per-query counters (see SearchStats). Only the outermost public call on a
+// thread resets and flushes them, so nested calls count as one query.
+static thread_local SearchStats tls_stats;
+static thread_local SearchStats tls_last_stats;
+static thread_local int tls_query_depth = 0;
+
+#if SEARCH_STATS
+#define SEARCH_STAT(expr) (expr)
+#else
+#define SEARCH_STAT(expr) ((void)0)
+#endif
+
+typedef std::chrono::steady_clock BuildClock;
+
+static inline double seconds_since(BuildClock::time_point t0)
+{
+    return std::chrono::duration<double>(BuildClock::now() - t0).count();
+}
+
+// Per-thread build counters, padded so neighbouring slots don't share a line.
+// Padded by hand rather than alignas(64): under -std=c++11 vector storage is
+// only 16-byte aligned, and the compiler would still emit aligned 64-byte
+// stores into it. A full line of padding keeps slots apart at any alignment.
+struct BuildStatsSlot
+{
+    BuildStats s;
+    char pad[64];
+};
+
+static inline int build_thread_id()
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+// Tick source for search deadlines: the TSC on x86 (a couple of dozen
+// cycles, no syscall), steady_clock nanoseconds elsewhere.
+static inline uint64_t read_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+// Ticks per millisecond, measured once against steady_clock
+static double ticks_per_ms()
+{
+    static const double rate = []()
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        uint64_t c0 = read_ticks();
+        while (std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(2))
+            ;
+        uint64_t c1 = read_ticks();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        return max(1.0, (c1 - c0) / ms);
+    }();
+    return rate;
+}
+
+// Layer-0 candidate pool entry (fixed-size sorted arrays, see search_layer)
+struct Candidate
+{
+    float dist;
+    int id;
+};
+
+// Number of the 16 floats at v that are < d, counting only the first n
+static inline int count_lt16(const float *v, float d, int n)
+{
+    unsigned mask;
+#if defined(USE_AVX512)
+    mask = _mm512_cmp_ps_mask(_mm512_loadu_ps(v), _mm512_set1_ps(d), _CMP_LT_OQ);
+#elif defined(USE_AVX2)
+    __m256 q = _mm256_set1_ps(d);
+    mask = (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(v), q, _CMP_LT_OQ)) |
+           ((unsigned)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(v + 8), q, _CMP_LT_OQ)) << 8);
+#elif defined(USE_SSE2)
+    __m128 q = _mm_set1_ps(d);
+    mask = 0;
+    for (int j = 0; j < 4; ++j)
+        mask |= (unsigned)_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(v + 4 * j), q)) << (4 * j);
+#else
+    mask = 0;
+    for (int j = 0; j < 16; ++j)
+        mask |= (unsigned)(v[j] < d) << j;
+#endif
+    return __builtin_popcount(mask & ((1u << n) - 1));
+}
+
+// Bounded sorted candidate pool shared by the graph walks (NSG / DiskANN
+// style). Distances and ids sit in separate arrays so an insert is a binary
+// search down to one 16-wide SIMD compare plus two memmoves; the top bit of an
+// id marks the slot as expanded, so a rewind never re-expands a node. Entries
+// pushed past the capacity fall off the end, unless the pool was reset as
+// growable, in which case the capacity doubles instead.
+struct CandidatePool
+{
+    static const int SIMD_WIDTH = 16;
+    static const unsigned EXPANDED = 0x80000000u;
+
+    vector<float> dist; // capacity + SIMD_WIDTH, tail padding is read but masked
+    vector<int> ids;
+    int size;
+    int capacity;
+    int cursor; // no unexpanded slot before this one
+    bool growable;
+
+    CandidatePool() : size(0), capacity(0), cursor(0), growable(false) {}
+
+    void reset(int cap, bool grow = false)
+    {
+        if ((int)dist.size() < cap + SIMD_WIDTH)
+        {
+            dist.assign(cap + SIMD_WIDTH, 0.0f);
+            ids.assign(cap + SIMD_WIDTH, 0);
+        }
+        size = 0;
+        capacity = cap;
+        cursor = 0;
+        growable = grow;
+    }
+
+    void enlarge()
+    {
+        capacity *= 2;
+        if ((int)dist.size() < capacity + SIMD_WIDTH)
+        {
+            dist.resize(capacity + SIMD_WIDTH, 0.0f);
+            ids.resize(capacity + SIMD_WIDTH, 0);
+        }
+    }
+
+    bool full() const { return size >= capacity; }
+    int id(int slot) const { return (int)((unsigned)ids[slot] & ~EXPANDED); }
+    // Distance of the n-th nearest entry (the last one when fewer are held)
+    float kth(int n) const { return dist[min(size, n) - 1]; }
+
+    // First slot holding a distance not less than d (a new entry goes ahead
+    // of equal ones, the order the two-heap walk produced)
+    int position(float d) const
+    {
+        int lo = 0, hi = size;
+        while (hi - lo > SIMD_WIDTH)
+        {
+            int mid = (lo + hi) >> 1;
+            if (dist[mid] < d)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo + count_lt16(&dist[lo], d, hi - lo);
+    }
+
+    // Inserts (d, v) unless the pool is full and d is no better than its
+    // worst entry. Returns the slot taken, or -1.
+    int insert(float d, int v)
+    {
+        if (size >= capacity)
+        {
+            if (growable)
+                enlarge();
+            else if (!(d < dist[size - 1]))
+                return -1;
+        }
+        int pos = position(d);
+        int tail = min(size, capacity - 1) - pos;
+        if (tail > 0)
+        {
+            memmove(&dist[pos + 1], &dist[pos], tail * sizeof(float));
+            memmove(&ids[pos + 1], &ids[pos], tail * sizeof(int));
+        }
+        dist[pos] = d;
+        ids[pos] = v;
+        if (size < capacity)
+            size++;
+        if (pos < cursor)
+            cursor = pos;
+        return pos;
+    }
+
+    // Nearest slot not yet expanded, marked expanded; -1 when every held
+    // entry has been expanded
+    int next()
+    {
+        while (cursor < size && ((unsigned)ids[cursor] & EXPANDED))
+            ++cursor;
+        if (cursor >= size)
+            return -1;
+        ids[cursor] = (int)((unsigned)ids[cursor] | EXPANDED);
+        return cursor++;
+    }
+
+    // Nearest unexpanded slot without claiming it (prefetch hint), or -1
+    int peek() const
+    {
+        for (int i = cursor; i < size; ++i)
+            if (!((unsigned)ids[i] & EXPANDED))
+                return i;
+        return -1;
+    }
+};
+
+// One pool per thread; the walks never nest, so they all share it
+static thread_local CandidatePool tls_pool;
+
 // ==================== Solution Implementation ====================
 
 Solution::Solution()
@@ -68,12 +286,35 @@ Solution::Solution()
     ml = 1.0 / log(2.0);
     max_level = 0;
     gamma = 0.0;
-    distance_computations.store(0);
+    user_params = false;
+    build_progress_interval = 1.0;
+    dimension = 0;
+    num_vectors = 0;
+    vec_data = nullptr;
+    metric = METRIC_L2;
+    index_type = INDEX_AUTO;
+    active_index = INDEX_HNSW;
+    flat_threshold = 2048;
+    range_result_limit = 10000;
+    prefetch_distance = 4;
+    prefetch_lines = 0;
+    prefetch_user = false;
+    reorder_dims = false;
+    rotate_vectors = false;
+    rotation_epsilon = 2.1f;
+    ivf_nlist = 0;
+    ivf_nprobe = 16;
+    reset_search_stats();
+    num_deleted.store(0);
+    compaction_threshold = 0.1f;
+    compaction_running.store(false);
     rng.seed(42);
+    ticks_per_ms(); // calibrate the deadline clock here, not inside a query
 }
 
 Solution::~Solution()
 {
+    wait_for_compaction();
 }
 
 void Solution::set_parameters(int M_val, int ef_c, int ef_s)
@@ -82,9 +323,10 @@ void Solution::set_parameters(int M_val, int ef_c, int ef_s)
     ef_construction = ef_c;
     ef_search = ef_s;
     ml = 1.0 / log(2.0);
+    user_params = true;
 }
 
-inline float Solution::distance(const float *a, const float *b, int dim) const
+static inline float l2_sqr(const float *a, const float *b, int dim)
 {
 #if defined(USE_AVX512)
     __m512 sum = _mm512_setzero_ps();
@@ -136,245 +378,1153 @@ inline float Solution::distance(const float *a, const float *b, int dim) const
 #endif
 }
 
-// 第八批优化：部分距离计算（用于早期剪枝，不计入统计）
-inline float Solution::partial_distance(const float *a, const float *b, int dim) const
+// l2_sqr that gives up once the running sum passes bound: after the k-th
+// block of 32 dimensions it stops as soon as the partial sum exceeds
+// bound * scale[k] (all ones = exact; below one = ADSampling's test, see
+// update_abandon_scale), stores partial / scale[k], which is above bound
+// either way, and returns false. A row that is not abandoned is summed in
+// exactly l2_sqr's order, so its distance is bit-identical; it returns true.
+static inline bool l2_sqr_bounded(const float *a, const float *b, int dim, float bound, const float *scale,
+                                  float *out)
 {
-    // 仅计算前16维距离进行快速失败检测
-    const int check_dim = min(dim, 16);
+#if defined(USE_AVX512)
+    __m512 sum = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32)
+    {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum = _mm512_fmadd_ps(d0, d0, sum);
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        sum = _mm512_fmadd_ps(d1, d1, sum);
+        if (i + 32 < dim)
+        {
+            float partial = _mm512_reduce_add_ps(sum);
+            if (partial > bound * scale[i >> 5])
+            {
+                *out = partial / scale[i >> 5];
+                return false;
+            }
+        }
+    }
+    for (; i + 16 <= dim; i += 16)
+    {
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    float total = _mm512_reduce_add_ps(sum);
+    for (; i < dim; ++i)
+    {
+        float diff = a[i] - b[i];
+        total += diff * diff;
+    }
+    *out = total;
+    return true;
+#elif defined(USE_AVX2)
+    __m256 sum = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8)
+    {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        sum = _mm256_fmadd_ps(diff, diff, sum);
+        if ((i & 31) == 24 && i + 8 < dim)
+        {
+            __m128 r = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+            r = _mm_hadd_ps(r, r);
+            r = _mm_hadd_ps(r, r);
+            float partial = _mm_cvtss_f32(r);
+            if (partial > bound * scale[i >> 5])
+            {
+                *out = partial / scale[i >> 5];
+                return false;
+            }
+        }
+    }
+    __m128 sum_low = _mm256_castps256_ps128(sum);
+    __m128 sum_high = _mm256_extractf128_ps(sum, 1);
+    __m128 res = _mm_add_ps(sum_low, sum_high);
+    res = _mm_hadd_ps(res, res);
+    res = _mm_hadd_ps(res, res);
+    float total = _mm_cvtss_f32(res);
+    for (; i < dim; ++i)
+    {
+        float diff = a[i] - b[i];
+        total += diff * diff;
+    }
+    *out = total;
+    return true;
+#else
     float dist = 0;
-    for (int i = 0; i < check_dim; ++i)
+    for (int i = 0; i < dim; ++i)
     {
         float d = a[i] - b[i];
         dist += d * d;
+        if ((i & 31) == 31 && dist > bound * scale[i >> 5])
+        {
+            *out = dist / scale[i >> 5];
+            return false;
+        }
     }
-    return dist;
+    *out = dist;
+    return true;
+#endif
 }
 
-int Solution::random_level()
+static inline float inner_product(const float *a, const float *b, int dim)
 {
-    double r = (double)rng() / (double)rng.max();
-    if (r < 1e-9)
-        r = 1e-9;
-    return (int)(-log(r) * ml);
+#if defined(USE_AVX512)
+    __m512 sum = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16)
+        sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum);
+    float total = _mm512_reduce_add_ps(sum);
+    for (; i < dim; ++i)
+        total += a[i] * b[i];
+    return total;
+#elif defined(USE_AVX2)
+    __m256 sum = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8)
+        sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum);
+    __m128 sum_low = _mm256_castps256_ps128(sum);
+    __m128 sum_high = _mm256_extractf128_ps(sum, 1);
+    __m128 res = _mm_add_ps(sum_low, sum_high);
+    res = _mm_hadd_ps(res, res);
+    res = _mm_hadd_ps(res, res);
+    float total = _mm_cvtss_f32(res);
+    for (; i < dim; ++i)
+        total += a[i] * b[i];
+    return total;
+#else
+    float dot = 0;
+    for (int i = 0; i < dim; ++i)
+        dot += a[i] * b[i];
+    return dot;
+#endif
 }
 
-// ==================== HNSW Core ====================
-
-vector<int> Solution::search_layer(const float *query, const vector<int> &entry_points,
-                                   int ef, int level) const
+// x . q for four queries in one pass over x (register-blocked GEMM micro-kernel)
+static inline void inner_product_x4(const float *x, const float *q0, const float *q1,
+                                    const float *q2, const float *q3, int dim, float *out)
 {
-    // Initialize Thread Local Storage
-    tls_visited.resize(num_vectors);
-    int tag = tls_visited.get_new_tag();
-    auto &visited = tls_visited.visited;
+    int i = 0;
+#if defined(USE_AVX512)
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16)
+    {
+        __m512 vx = _mm512_loadu_ps(x + i);
+        s0 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q0 + i), s0);
+        s1 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q1 + i), s1);
+        s2 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q2 + i), s2);
+        s3 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q3 + i), s3);
+    }
+    out[0] = _mm512_reduce_add_ps(s0);
+    out[1] = _mm512_reduce_add_ps(s1);
+    out[2] = _mm512_reduce_add_ps(s2);
+    out[3] = _mm512_reduce_add_ps(s3);
+#elif defined(USE_AVX2)
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8)
+    {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        s0 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q0 + i), s0);
+        s1 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q1 + i), s1);
+        s2 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q2 + i), s2);
+        s3 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q3 + i), s3);
+    }
+    // 4x8 -> 4 horizontal sums with two hadd rounds
+    __m256 h01 = _mm256_hadd_ps(s0, s1);
+    __m256 h23 = _mm256_hadd_ps(s2, s3);
+    __m256 h = _mm256_hadd_ps(h01, h23);
+    __m128 r = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+    _mm_storeu_ps(out, r);
+#else
+    out[0] = out[1] = out[2] = out[3] = 0;
+#endif
+    for (; i < dim; ++i)
+    {
+        out[0] += x[i] * q0[i];
+        out[1] += x[i] * q1[i];
+        out[2] += x[i] * q2[i];
+        out[3] += x[i] * q3[i];
+    }
+}
 
-    // === 第七批优化：Layer 0 极致性能路径 ===
-    // 针对 Layer 0（搜索瓶颈所在），使用固定数组替代优先队列，减少堆操作开销
-    if (level == 0 && !final_graph_flat.empty())
+// ||q - x_j||^2 for four vectors in one pass over q: four independent
+// accumulators, reduced once at the end (one-query-to-many kernel of the
+// layer-0 walk; same shape as inner_product_x4)
+static inline void l2_sqr_x4(const float *q, const float *x0, const float *x1,
+                             const float *x2, const float *x3, int dim, float *out)
+{
+    int i = 0;
+#if defined(USE_AVX512)
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16)
     {
-        // 固定大小候选池（避免动态内存分配）
-        struct Candidate
-        {
-            float dist;
-            int id;
-        };
-        Candidate W[512]; // 足够容纳 ef_search（通常200）
-        int W_size = 0;
+        __m512 vq = _mm512_loadu_ps(q + i);
+        __m512 d0 = _mm512_sub_ps(vq, _mm512_loadu_ps(x0 + i));
+        __m512 d1 = _mm512_sub_ps(vq, _mm512_loadu_ps(x1 + i));
+        __m512 d2 = _mm512_sub_ps(vq, _mm512_loadu_ps(x2 + i));
+        __m512 d3 = _mm512_sub_ps(vq, _mm512_loadu_ps(x3 + i));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+        s2 = _mm512_fmadd_ps(d2, d2, s2);
+        s3 = _mm512_fmadd_ps(d3, d3, s3);
+    }
+    out[0] = _mm512_reduce_add_ps(s0);
+    out[1] = _mm512_reduce_add_ps(s1);
+    out[2] = _mm512_reduce_add_ps(s2);
+    out[3] = _mm512_reduce_add_ps(s3);
+#elif defined(USE_AVX2)
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8)
+    {
+        __m256 vq = _mm256_loadu_ps(q + i);
+        __m256 d0 = _mm256_sub_ps(vq, _mm256_loadu_ps(x0 + i));
+        __m256 d1 = _mm256_sub_ps(vq, _mm256_loadu_ps(x1 + i));
+        __m256 d2 = _mm256_sub_ps(vq, _mm256_loadu_ps(x2 + i));
+        __m256 d3 = _mm256_sub_ps(vq, _mm256_loadu_ps(x3 + i));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+        s2 = _mm256_fmadd_ps(d2, d2, s2);
+        s3 = _mm256_fmadd_ps(d3, d3, s3);
+    }
+    __m256 h01 = _mm256_hadd_ps(s0, s1);
+    __m256 h23 = _mm256_hadd_ps(s2, s3);
+    __m256 h = _mm256_hadd_ps(h01, h23);
+    __m128 r = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+    _mm_storeu_ps(out, r);
+#else
+    out[0] = out[1] = out[2] = out[3] = 0;
+#endif
+    for (; i < dim; ++i)
+    {
+        float d0 = q[i] - x0[i], d1 = q[i] - x1[i], d2 = q[i] - x2[i], d3 = q[i] - x3[i];
+        out[0] += d0 * d0;
+        out[1] += d1 * d1;
+        out[2] += d2 * d2;
+        out[3] += d3 * d3;
+    }
+}
 
-        // 初始化候选集
-        for (int ep : entry_points)
+// l2_sqr_x4 with early abandon: every 32 dimensions the four running sums
+// are checked, and once all of them exceed the checkpoint's threshold they
+// are stored divided by its scale and false is returned (as in
+// l2_sqr_bounded). Rows are summed in l2_sqr_x4's order, so finished ones
+// match it; true means all four ran to the last dimension.
+static inline void unscale4(float *out, float s)
+{
+    out[0] /= s;
+    out[1] /= s;
+    out[2] /= s;
+    out[3] /= s;
+}
+
+static inline bool l2_sqr_x4_bounded(const float *q, const float *x0, const float *x1, const float *x2,
+                                     const float *x3, int dim, float bound, const float *scale, float *out)
+{
+    int i = 0;
+#if defined(USE_AVX512)
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    for (; i + 16 <= dim; i += 16)
+    {
+        __m512 vq = _mm512_loadu_ps(q + i);
+        __m512 d0 = _mm512_sub_ps(vq, _mm512_loadu_ps(x0 + i));
+        __m512 d1 = _mm512_sub_ps(vq, _mm512_loadu_ps(x1 + i));
+        __m512 d2 = _mm512_sub_ps(vq, _mm512_loadu_ps(x2 + i));
+        __m512 d3 = _mm512_sub_ps(vq, _mm512_loadu_ps(x3 + i));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+        s2 = _mm512_fmadd_ps(d2, d2, s2);
+        s3 = _mm512_fmadd_ps(d3, d3, s3);
+        if ((i & 31) == 16 && i + 16 < dim)
         {
-            if (visited[ep] != tag)
+            out[0] = _mm512_reduce_add_ps(s0);
+            out[1] = _mm512_reduce_add_ps(s1);
+            out[2] = _mm512_reduce_add_ps(s2);
+            out[3] = _mm512_reduce_add_ps(s3);
+            float t = bound * scale[i >> 5];
+            if (out[0] > t && out[1] > t && out[2] > t && out[3] > t)
             {
-                visited[ep] = tag;
-                float d = distance(query, &vectors[ep * dimension], dimension);
-                W[W_size++] = {d, ep};
+                unscale4(out, scale[i >> 5]);
+                return false;
             }
         }
-
-        // 排序保持候选集有序（小根堆效果）
-        sort(W, W + W_size, [](const Candidate &a, const Candidate &b) { return a.dist < b.dist; });
-
-        int curr_pos = 0; // 当前正在探测的节点在 W 中的位置
-
-        while (curr_pos < W_size && curr_pos < ef)
+    }
+    out[0] = _mm512_reduce_add_ps(s0);
+    out[1] = _mm512_reduce_add_ps(s1);
+    out[2] = _mm512_reduce_add_ps(s2);
+    out[3] = _mm512_reduce_add_ps(s3);
+#elif defined(USE_AVX2)
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8)
+    {
+        __m256 vq = _mm256_loadu_ps(q + i);
+        __m256 d0 = _mm256_sub_ps(vq, _mm256_loadu_ps(x0 + i));
+        __m256 d1 = _mm256_sub_ps(vq, _mm256_loadu_ps(x1 + i));
+        __m256 d2 = _mm256_sub_ps(vq, _mm256_loadu_ps(x2 + i));
+        __m256 d3 = _mm256_sub_ps(vq, _mm256_loadu_ps(x3 + i));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+        s2 = _mm256_fmadd_ps(d2, d2, s2);
+        s3 = _mm256_fmadd_ps(d3, d3, s3);
+        if ((i & 31) == 24 && i + 8 < dim)
         {
-            // 取得当前最近且未探测的点
-            Candidate current = W[curr_pos++];
-
-            // 提前终止：当前点比第 ef 个点慢太多，不需要继续
-            if (W_size >= ef && current.dist > W[ef - 1].dist * 1.05f)
-                break;
-
-            // 快速访问 Layer 0 扁平化邻居
-            int max_neighbors_l0 = 2 * M;
-            long long offset = (long long)current.id * (max_neighbors_l0 + 1);
-            int neighbor_count = final_graph_flat[offset];
-            const int *neighbors_ptr = &final_graph_flat[offset + 1];
-
-            // 批量预取后续邻居的向量数据
-            for (int i = 0; i < neighbor_count; ++i)
+            __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(s0, s1), _mm256_hadd_ps(s2, s3));
+            __m128 r = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+            if (_mm_movemask_ps(_mm_cmpgt_ps(r, _mm_set1_ps(bound * scale[i >> 5]))) == 0xF)
             {
-                int nid = neighbors_ptr[i];
-
-                // 流水线预取：提前 4 个邻居预取向量数据（比 2 更积极）
-                if (i + 4 < neighbor_count)
-                {
-                    _mm_prefetch((const char *)&vectors[neighbors_ptr[i + 4] * dimension], _MM_HINT_T0);
-                }
-
-                if (visited[nid] != tag)
-                {
-                    // 1. Visited 标记
-                    visited[nid] = tag;
-                    
-                    // 获取当前 W 中最远点的距离
-                    float max_dist_in_W = W_size >= ef ? W[ef - 1].dist : numeric_limits<float>::max();
-
-                    // 2. 🔴 早期剪枝（第八批关键优化）
-                    // 仅计算前 16 维距离。如果部分距离已远超 W 中最远距离，则跳过完整的 distance() 计算。
-                    float partial_d = partial_distance(query, &vectors[nid * dimension], dimension);
-                    
-                    // 剪枝阈值：使用1.5倍容错，避免过度剪枝损害召回率
-                    // 只有在部分距离明显超过最差距离时才跳过
-                    if (W_size >= ef && partial_d > max_dist_in_W * 1.5f) {
-                        continue; 
-                    }
-
-                    // 3. 完整的 distance 计算（计入统计）
-                    float d = distance(query, &vectors[nid * dimension], dimension);
-
-                    // 4. 插入排序和回溯逻辑
-                    if (W_size < ef || d < W[min(W_size, ef) - 1].dist)
-                    {
-                        // 插入排序保持 W 有序（比堆操作更适合小规模 ef）
-                        int insert_pos = min(W_size, ef);
-                        while (insert_pos > 0 && W[insert_pos - 1].dist > d)
-                        {
-                            if (insert_pos < 512)
-                                W[insert_pos] = W[insert_pos - 1];
-                            insert_pos--;
-                        }
-
-                        if (insert_pos < ef)
-                        {
-                            W[insert_pos] = {d, nid};
-                            if (W_size < ef)
-                                W_size++;
-
-                            // 贪婪指针回溯：如果插入的位置比当前处理位置更近，重置探索指针
-                            if (insert_pos < curr_pos)
-                                curr_pos = insert_pos;
-                        }
-                    }
-                }
+                _mm_storeu_ps(out, _mm_div_ps(r, _mm_set1_ps(scale[i >> 5])));
+                return false;
             }
         }
-
-        // 构造结果
-        vector<int> result;
-        result.reserve(min(W_size, ef));
-        for (int i = 0; i < min(W_size, ef); ++i)
-            result.push_back(W[i].id);
-        return result;
     }
-
-    // === 非 Layer 0 层保持原有逻辑（优先队列） ===
-    auto cmp_min = [](const pair<float, int> &a, const pair<float, int> &b)
-    { return a.first > b.first; };
-    priority_queue<pair<float, int>, vector<pair<float, int>>, decltype(cmp_min)> candidates(cmp_min);
-
-    auto cmp_max = [](const pair<float, int> &a, const pair<float, int> &b)
-    { return a.first < b.first; };
-    priority_queue<pair<float, int>, vector<pair<float, int>>, decltype(cmp_max)> W(cmp_max);
-
-    for (int ep : entry_points)
+    __m256 h01 = _mm256_hadd_ps(s0, s1);
+    __m256 h23 = _mm256_hadd_ps(s2, s3);
+    __m256 h = _mm256_hadd_ps(h01, h23);
+    __m128 r = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+    _mm_storeu_ps(out, r);
+#else
+    out[0] = out[1] = out[2] = out[3] = 0;
+#endif
+    for (; i < dim; ++i)
     {
-        if (visited[ep] != tag)
+        float d0 = q[i] - x0[i], d1 = q[i] - x1[i], d2 = q[i] - x2[i], d3 = q[i] - x3[i];
+        out[0] += d0 * d0;
+        out[1] += d1 * d1;
+        out[2] += d2 * d2;
+        out[3] += d3 * d3;
+        if ((i & 31) == 31)
         {
-            visited[ep] = tag;
-            float dist = distance(query, &vectors[ep * dimension], dimension);
-            candidates.push({dist, ep});
-            W.push({dist, ep});
+            float t = bound * scale[i >> 5];
+            if (out[0] > t && out[1] > t && out[2] > t && out[3] > t)
+            {
+                unscale4(out, scale[i >> 5]);
+                return false;
+            }
         }
     }
+    return true;
+}
 
-    float lower_bound = numeric_limits<float>::max();
-    if (!W.empty())
-        lower_bound = W.top().first;
+// ==================== Metric Spaces ====================
+// Compile-time distance policies for the templated search / pruning code.
+// Smaller is always closer. relax() widens a bound by a relative slack and
+// stays correct for negative distances (inner product).
+// early_abandon: every prefix of the sum lower-bounds the full distance, so
+// dist_bounded() may stop once it passes the bound scaled per 32-dim
+// checkpoint (other metrics ignore both). The bounded forms return false
+// when they stopped before the last dimension.
 
-    while (!candidates.empty())
+struct L2Space
+{
+    static const bool early_abandon = true;
+    static inline float dist(const float *a, const float *b, int dim) { return l2_sqr(a, b, dim); }
+    static inline bool dist_bounded(const float *a, const float *b, int dim, float bound, const float *scale,
+                                    float *out)
+    {
+        return l2_sqr_bounded(a, b, dim, bound, scale, out);
+    }
+    static inline bool dist_x4_bounded(const float *q, const float *const *x, int dim, float bound,
+                                       const float *scale, float *out)
+    {
+        return l2_sqr_x4_bounded(q, x[0], x[1], x[2], x[3], dim, bound, scale, out);
+    }
+    static inline void dist_x4(const float *q, const float *const *x, int dim, float *out)
     {
-        auto current = candidates.top();
-        candidates.pop();
-        float current_dist = current.first;
-        int current_id = current.second;
+        l2_sqr_x4(q, x[0], x[1], x[2], x[3], dim, out);
+    }
+    static inline float relax(float d, float slack) { return d * (1.0f + slack); }
+};
 
-        if (current_dist > lower_bound)
-            break;
+struct IPSpace
+{
+    static const bool early_abandon = false;
+    static inline float dist(const float *a, const float *b, int dim) { return -inner_product(a, b, dim); }
+    static inline bool dist_bounded(const float *a, const float *b, int dim, float, const float *, float *out)
+    {
+        *out = dist(a, b, dim);
+        return true;
+    }
+    static inline bool dist_x4_bounded(const float *q, const float *const *x, int dim, float, const float *,
+                                       float *out)
+    {
+        dist_x4(q, x, dim, out);
+        return true;
+    }
+    static inline void dist_x4(const float *q, const float *const *x, int dim, float *out)
+    {
+        inner_product_x4(q, x[0], x[1], x[2], x[3], dim, out);
+        for (int j = 0; j < 4; ++j)
+            out[j] = -out[j];
+    }
+    static inline float relax(float d, float slack) { return d + fabsf(d) * slack; }
+};
 
-        const int *neighbors_ptr = nullptr;
-        int neighbor_count = 0;
+// Vectors (base and query) are unit-normalized, so cosine is one dot product
+struct CosineSpace
+{
+    static const bool early_abandon = false;
+    static inline float dist(const float *a, const float *b, int dim) { return 1.0f - inner_product(a, b, dim); }
+    static inline bool dist_bounded(const float *a, const float *b, int dim, float, const float *, float *out)
+    {
+        *out = dist(a, b, dim);
+        return true;
+    }
+    static inline bool dist_x4_bounded(const float *q, const float *const *x, int dim, float, const float *,
+                                       float *out)
+    {
+        dist_x4(q, x, dim, out);
+        return true;
+    }
+    static inline void dist_x4(const float *q, const float *const *x, int dim, float *out)
+    {
+        inner_product_x4(q, x[0], x[1], x[2], x[3], dim, out);
+        for (int j = 0; j < 4; ++j)
+            out[j] = 1.0f - out[j];
+    }
+    static inline float relax(float d, float slack) { return d * (1.0f + slack); }
+};
+
+static void normalize_vector(float *v, int dim)
+{
+    float norm = sqrtf(inner_product(v, v, dim));
+    if (norm > 0)
+    {
+        float inv = 1.0f / norm;
+        for (int i = 0; i < dim; ++i)
+            v[i] *= inv;
+    }
+}
+
+inline float Solution::distance(const float *a, const float *b, int dim) const
+{
+    SEARCH_STAT(tls_stats.distance_calls++);
+    switch (metric)
+    {
+    case METRIC_IP:
+        return IPSpace::dist(a, b, dim);
+    case METRIC_COSINE:
+        return CosineSpace::dist(a, b, dim);
+    default:
+        return L2Space::dist(a, b, dim);
+    }
+}
+
+const float *Solution::prepare_query(const vector<float> &query, vector<float> &scratch) const
+{
+    if (!rotation.empty())
+    {
+        scratch.resize(dimension);
+        rotate_row(query.data(), scratch.data());
+        return scratch.data();
+    }
+    if (!dim_order.empty())
+    {
+        scratch.resize(dimension);
+        for (int j = 0; j < dimension; ++j)
+            scratch[j] = query[dim_order[j]];
+        return scratch.data();
+    }
+    if (metric != METRIC_COSINE)
+        return query.data();
+    scratch = query;
+    normalize_vector(scratch.data(), dimension);
+    return scratch.data();
+}
+
+const float *Solution::prepare_queries(const vector<float> &queries, vector<float> &scratch) const
+{
+    int nq = dimension > 0 ? queries.size() / dimension : 0;
+    if (!rotation.empty())
+    {
+        scratch.resize((size_t)nq * dimension);
+        for (int i = 0; i < nq; ++i)
+            rotate_row(&queries[(long long)i * dimension], &scratch[(long long)i * dimension]);
+        return scratch.data();
+    }
+    if (!dim_order.empty())
+    {
+        scratch.resize((size_t)nq * dimension);
+        for (int i = 0; i < nq; ++i)
+            for (int j = 0; j < dimension; ++j)
+                scratch[(long long)i * dimension + j] = queries[(long long)i * dimension + dim_order[j]];
+        return scratch.data();
+    }
+    if (metric != METRIC_COSINE)
+        return queries.data();
+    scratch = queries;
+    for (int i = 0; i < nq; ++i)
+        normalize_vector(&scratch[(long long)i * dimension], dimension);
+    return scratch.data();
+}
+
+// y = R x for the stored rotation (row-major D x D)
+void Solution::rotate_row(const float *x, float *y) const
+{
+    for (int j = 0; j < dimension; ++j)
+        y[j] = inner_product(&rotation[(long long)j * dimension], x, dimension);
+}
 
-        if (level < graph.size())
+// Random orthogonal D x D matrix (Gram-Schmidt on a Gaussian one, fixed seed
+// so rebuilds are reproducible); every row of `vectors` is rotated by it
+void Solution::make_rotation()
+{
+    int D = dimension;
+    mt19937 rot_rng(20240607);
+    normal_distribution<double> gauss(0.0, 1.0);
+    vector<double> R((size_t)D * D);
+    for (double &x : R)
+        x = gauss(rot_rng);
+    for (int j = 0; j < D; ++j)
+    {
+        double *r = &R[(size_t)j * D];
+        for (int p = 0; p < j; ++p)
         {
-            const auto &vec = graph[level][current_id];
-            neighbor_count = vec.size();
-            neighbors_ptr = vec.data();
+            const double *e = &R[(size_t)p * D];
+            double dot = 0.0;
+            for (int t = 0; t < D; ++t)
+                dot += r[t] * e[t];
+            for (int t = 0; t < D; ++t)
+                r[t] -= dot * e[t];
         }
+        double norm = 0.0;
+        for (int t = 0; t < D; ++t)
+            norm += r[t] * r[t];
+        norm = sqrt(norm);
+        for (int t = 0; t < D; ++t)
+            r[t] /= norm;
+    }
+    rotation.assign(R.begin(), R.end());
 
-        // Prefetch
-        if (neighbor_count > 0)
+#pragma omp parallel
+    {
+        vector<float> row(D);
+#pragma omp for schedule(static)
+        for (int i = 0; i < num_vectors; ++i)
         {
-            _mm_prefetch((const char *)&vectors[neighbors_ptr[0] * dimension], _MM_HINT_T0);
-            if (neighbor_count > 1)
-                _mm_prefetch((const char *)&vectors[neighbors_ptr[1] * dimension], _MM_HINT_T0);
+            float *x = &vectors[(long long)i * D];
+            copy(x, x + D, row.begin());
+            rotate_row(row.data(), x);
         }
+    }
+}
 
-        for (int i = 0; i < neighbor_count; ++i)
+// ADSampling's test on a randomly rotated vector: after d of D dimensions,
+// partial * D / d estimates the distance within a relative error of about
+// epsilon0 / sqrt(d), so partial > bound * (d / D) * (1 + epsilon0 / sqrt(d))^2
+// rejects with a false-prune probability that falls as exp(-c epsilon0^2).
+// Factors are capped at 1, where the test becomes the exact one.
+void Solution::update_abandon_scale()
+{
+    abandon_scale.assign(dimension / 32 + 1, 1.0f);
+    if (rotation.empty() || rotation_epsilon <= 0.0f)
+        return;
+    for (int k = 0; 32 * (k + 1) < dimension; ++k)
+    {
+        float d = 32.0f * (k + 1);
+        float f = 1.0f + rotation_epsilon / sqrtf(d);
+        abandon_scale[k] = min(1.0f, d / dimension * f * f);
+    }
+}
+
+void Solution::set_random_rotation(bool on, float epsilon0)
+{
+    rotate_vectors = on;
+    rotation_epsilon = max(0.0f, epsilon0);
+    update_abandon_scale();
+}
+
+// Per-dimension variance over (a sample of) the base, highest first; the rows
+// of `vectors` are permuted in place to that order
+void Solution::reorder_dimensions()
+{
+    int step = max(1, num_vectors / 20000);
+    vector<double> sum(dimension, 0.0), sum_sq(dimension, 0.0);
+    int n = 0;
+    for (int i = 0; i < num_vectors; i += step, ++n)
+    {
+        const float *x = &vectors[(long long)i * dimension];
+        for (int j = 0; j < dimension; ++j)
+        {
+            sum[j] += x[j];
+            sum_sq[j] += (double)x[j] * x[j];
+        }
+    }
+    vector<double> var(dimension);
+    for (int j = 0; j < dimension; ++j)
+        var[j] = n > 0 ? sum_sq[j] / n - (sum[j] / n) * (sum[j] / n) : 0.0;
+
+    dim_order.resize(dimension);
+    for (int j = 0; j < dimension; ++j)
+        dim_order[j] = j;
+    stable_sort(dim_order.begin(), dim_order.end(), [&](int a, int b) { return var[a] > var[b]; });
+
+    vector<float> row(dimension);
+    for (int i = 0; i < num_vectors; ++i)
+    {
+        float *x = &vectors[(long long)i * dimension];
+        copy(x, x + dimension, row.begin());
+        for (int j = 0; j < dimension; ++j)
+            x[j] = row[dim_order[j]];
+    }
+}
+
+// Whole cache lines covering the row (rows need not be 64-byte aligned)
+inline void Solution::prefetch_vector(int id) const
+{
+    const char *p = (const char *)&vec_data[(long long)id * dimension];
+    uintptr_t first = (uintptr_t)p >> 6;
+    uintptr_t last = ((uintptr_t)p + dimension * sizeof(float) - 1) >> 6;
+    int lines = (int)(last - first) + 1;
+    if (prefetch_lines > 0 && prefetch_lines < lines)
+        lines = prefetch_lines;
+    for (int i = 0; i < lines; ++i)
+        _mm_prefetch((const char *)((first + i) << 6), _MM_HINT_T0);
+}
+
+inline void Solution::prefetch_row(int id) const
+{
+    _mm_prefetch((const char *)&final_graph_flat[(long long)id * (2 * M + 1)], _MM_HINT_T0);
+}
+
+int Solution::random_level()
+{
+    double r = (double)rng() / (double)rng.max();
+    if (r < 1e-9)
+        r = 1e-9;
+    return (int)(-log(r) * ml);
+}
+
+// ==================== HNSW Core ====================
+
+vector<int> Solution::search_layer(const float *query, const vector<int> &entry_points,
+                                   int level, const SearchParams &params, float stop_bound,
+                                   const TerminationModel *model, QueryTrace *trace,
+                                   SearchBudget *budget) const
+{
+    switch (metric)
+    {
+    case METRIC_IP:
+        return search_layer_impl<IPSpace>(query, entry_points, level, params, stop_bound, model, trace, budget);
+    case METRIC_COSINE:
+        return search_layer_impl<CosineSpace>(query, entry_points, level, params, stop_bound, model, trace, budget);
+    default:
+        return search_layer_impl<L2Space>(query, entry_points, level, params, stop_bound, model, trace, budget);
+    }
+}
+
+int Solution::greedy_descent(const float *query, int ep, int top, int bottom) const
+{
+    switch (metric)
+    {
+    case METRIC_IP:
+        return greedy_descent_impl<IPSpace>(query, ep, top, bottom);
+    case METRIC_COSINE:
+        return greedy_descent_impl<CosineSpace>(query, ep, top, bottom);
+    default:
+        return greedy_descent_impl<L2Space>(query, ep, top, bottom);
+    }
+}
+
+// Hop / time allowance of one query, armed at search entry from its
+// SearchParams. Layer 0 polls it every CHECK_EVERY expansions; the tick
+// counter is read only when a time budget is set.
+struct SearchBudget
+{
+    static const int CHECK_EVERY = 16;
+    int max_hops;
+    bool timed;
+    uint64_t deadline;
+    bool truncated;
+
+    explicit SearchBudget(const SearchParams &p)
+        : max_hops(p.max_hops > 0 ? p.max_hops : INT_MAX), timed(p.time_budget_ms > 0.0f), deadline(0), truncated(false)
+    {
+        if (timed)
+            deadline = read_ticks() + (uint64_t)(p.time_budget_ms * ticks_per_ms());
+    }
+
+    bool limited() const { return timed || max_hops != INT_MAX; }
+
+    // hops = layer-0 expansions so far in this walk
+    bool exhausted(int hops)
+    {
+        if (hops >= max_hops || (timed && hops % CHECK_EVERY == CHECK_EVERY - 1 && read_ticks() >= deadline))
+            truncated = true;
+        return truncated;
+    }
+};
+
+// MLE local intrinsic dimensionality over the n nearest (sorted) candidates:
+// -1 / mean(log(d_i / d_n)). Squared L2 only rescales it by 2, which the
+// termination model absorbs. Returns 0 when undefined (e.g. IP distances).
+static float estimate_lid(const float *dist, int n)
+{
+    if (n < 2 || dist[n - 1] <= 0.0f)
+        return 0.0f;
+    float d_max = dist[n - 1];
+    double sum = 0.0;
+    int cnt = 0;
+    for (int i = 0; i < n - 1; ++i)
+    {
+        if (dist[i] <= 0.0f)
+            continue;
+        sum += log(dist[i] / d_max);
+        ++cnt;
+    }
+    return (cnt > 0 && sum < 0.0) ? (float)(-cnt / sum) : 0.0f;
+}
+
+// Same walk as search_layer with ef=1, minus the pool and the visited tags:
+// a neighbor seen before is never better than the current best (the best
+// only improves), so rescoring it is harmless and cheaper than tracking it.
+template <class Space>
+int Solution::greedy_descent_impl(const float *query, int ep, int top, int bottom) const
+{
+    top = min(top, (int)graph.size() - 1);
+    if (top < bottom)
+        return ep;
+
+    float best = Space::dist(query, &vec_data[(long long)ep * dimension], dimension);
+    SEARCH_STAT(tls_stats.visited++);
+    SEARCH_STAT(tls_stats.distance_calls++);
+
+    for (int level = top; level >= bottom; --level)
+    {
+        if (level > 0)
+            SEARCH_STAT(tls_stats.levels_descended++);
+        bool moved = true;
+        while (moved)
         {
-            int neighbor = neighbors_ptr[i];
+            moved = false;
+            SEARCH_STAT(tls_stats.hops++);
+            const vector<int> &adj = graph[level][ep];
+            const int *neighbors_ptr = adj.data();
+            int neighbor_count = adj.size();
+
+            const int pd = prefetch_distance;
+            for (int i = 0; i < min(pd, neighbor_count); ++i)
+                prefetch_vector(neighbors_ptr[i]);
+
+            int next = ep;
+            for (int i = 0; i < neighbor_count; ++i)
+            {
+                if (i + pd < neighbor_count)
+                    prefetch_vector(neighbors_ptr[i + pd]);
+                int nid = neighbors_ptr[i];
+                float d = Space::dist(query, &vec_data[(long long)nid * dimension], dimension);
+                SEARCH_STAT(tls_stats.visited++);
+                SEARCH_STAT(tls_stats.distance_calls++);
+                if (d < best)
+                {
+                    best = d;
+                    next = nid;
+                }
+            }
+            if (next != ep)
+            {
+                ep = next;
+                moved = true;
+            }
+        }
+    }
+    return ep;
+}
+
+// ==================== Search kernel ====================
+// search_kernel is the one graph walk. What differs between searches is the
+// pool size (and whether it may grow), what a neighbor must beat to get in,
+// when the walk stops and how much of the pool is returned; a stop policy
+// answers those inline (and sees every fully scored vertex), so each
+// (metric, policy) pair compiles to its own loop. Per-query statistics are
+// the compile-time SEARCH_STATS switch; the anytime budget is a runtime
+// pointer because it is armed per call.
+
+// Insertions above this rank count as improving the result (learned stop)
+static const int K_TRACK = 10;
+
+// Fixed-ef walk: a pool of ef, stopped once the nearest unexpanded candidate
+// is past the ef-th (1.05 slack) or past an external k-th best.
+template <class Space>
+struct FixedEfStop
+{
+    int ef;
+    float stop_bound;
+
+    static const bool unbounded = false;
 
-            if (i + 2 < neighbor_count)
+    FixedEfStop(int ef_, float stop_bound_) : ef(ef_), stop_bound(stop_bound_) {}
+
+    int capacity() const { return ef; }
+    // Distance a new neighbor has to beat; unbounded while the pool has room
+    float admit_bound(const CandidatePool &W) const
+    {
+        return W.full() ? W.dist[ef - 1] : numeric_limits<float>::max();
+    }
+    bool done(const CandidatePool &W, float d)
+    {
+        return (W.full() && d > Space::relax(W.dist[ef - 1], 0.05f)) || d > Space::relax(stop_bound, 0.05f);
+    }
+    void scored(float, int) {}
+    void expanded(bool) {}
+    void finish() {}
+    int result_size(const CandidatePool &W) const { return W.size; }
+};
+
+// Fixed-ef walk that also stops after `patience` expansions without a top-10
+// change; patience comes from the termination model once `warmup` hops have
+// fixed the query's LID and early gain. With a model the patience rule takes
+// the place of the 1.05 slack (only the external bound still applies);
+// without one (trace only) the fixed walk's test is kept. Fills trace when
+// asked.
+template <class Space>
+struct LearnedStop : FixedEfStop<Space>
+{
+    const TerminationModel *model;
+    QueryTrace *trace;
+    int hops, since_improve, max_gap, warmup, patience;
+    float first_kth, lid, gain;
+
+    LearnedStop(int ef_, float stop_bound_, const TerminationModel *model_, QueryTrace *trace_)
+        : FixedEfStop<Space>(ef_, stop_bound_), model(model_), trace(trace_), hops(0), since_improve(0),
+          max_gap(0), warmup(model_ ? model_->warmup : TerminationModel().warmup),
+          patience(numeric_limits<int>::max()), first_kth(0.0f), lid(0.0f), gain(1.0f) {}
+
+    bool done(const CandidatePool &W, float d)
+    {
+        if (model && hops >= warmup && since_improve >= patience)
+            return true;
+        float kth = W.kth(K_TRACK);
+        if (hops == 1)
+            first_kth = kth;
+        if (hops == warmup)
+        {
+            lid = estimate_lid(&W.dist[0], min(W.size, 2 * K_TRACK));
+            gain = (first_kth > 0.0f && kth > 0.0f) ? kth / first_kth : 1.0f;
+            if (model)
             {
-                _mm_prefetch((const char *)&vectors[neighbors_ptr[i + 2] * dimension], _MM_HINT_T0);
+                float p = expf(model->w[0] + model->w[1] * lid + model->w[2] * gain);
+                patience = (int)min(1e6f, max((float)model->min_patience, p));
             }
+        }
+        ++hops;
+        if (model)
+            return d > Space::relax(this->stop_bound, 0.05f);
+        return FixedEfStop<Space>::done(W, d);
+    }
+
+    void expanded(bool improved)
+    {
+        if (improved)
+        {
+            max_gap = max(max_gap, since_improve);
+            since_improve = 0;
+        }
+        else
+        {
+            ++since_improve;
+        }
+    }
+
+    void finish()
+    {
+        if (trace)
+        {
+            trace->lid = lid;
+            trace->gain = gain;
+            trace->hops = hops;
+            trace->max_gap = max_gap;
+        }
+    }
+};
+
+// Gamma-adaptive walk: keeps expanding while the nearest candidate is within
+// relax(k-th, gamma) of the ef-th result. The first ef slots are the result
+// set; the pool is unbounded (it starts at 2 * ef and doubles), so every
+// candidate admitted inside the relaxed bound stays on the frontier, as it
+// did in the two-heap walk.
+template <class Space>
+struct AdaptiveStop
+{
+    static const bool unbounded = true;
+    int ef;
+    float gamma;
+
+    AdaptiveStop(int ef_, float gamma_) : ef(ef_), gamma(gamma_) {}
+
+    int capacity() const { return 2 * ef; }
+    float admit_bound(const CandidatePool &W) const
+    {
+        return W.size < ef ? numeric_limits<float>::max() : Space::relax(W.kth(ef), gamma);
+    }
+    bool done(const CandidatePool &W, float d)
+    {
+        return W.size >= ef && d > Space::relax(W.kth(ef), gamma);
+    }
+    void scored(float, int) {}
+    void expanded(bool) {}
+    void finish() {}
+    int result_size(const CandidatePool &W) const { return min(W.size, ef); }
+};
+
+// Filtered walk (search_filtered): the pool of ef expands every vertex, so
+// the graph stays connected under the predicate, while matching live
+// vertices are collected apart in a max-heap of result_cap. The walk stops
+// once the nearest unexpanded candidate is past the worst match held; a
+// neighbor is scored in full while it could still enter either set.
+template <class Space>
+struct FilteredStop : FixedEfStop<Space>
+{
+    int result_cap;
+    const SearchFilter &filter;
+    const vector<std::atomic<uint64_t>> *tombstones; // null when nothing is deleted
+    vector<pair<float, int>> matches;                // max-heap on distance
+
+    FilteredStop(int ef_, int result_cap_, const SearchFilter &filter_,
+                 const vector<std::atomic<uint64_t>> *tombstones_)
+        : FixedEfStop<Space>(ef_, numeric_limits<float>::max()), result_cap(result_cap_), filter(filter_),
+          tombstones(tombstones_)
+    {
+        matches.reserve(result_cap + 1);
+    }
+
+    float match_bound() const
+    {
+        return (int)matches.size() < result_cap ? numeric_limits<float>::max() : matches.front().first;
+    }
+    float admit_bound(const CandidatePool &W) const
+    {
+        return max(FixedEfStop<Space>::admit_bound(W), match_bound());
+    }
+    bool done(const CandidatePool &, float d) { return d > match_bound(); }
+    void scored(float d, int id)
+    {
+        if (!(d < match_bound()) || !filter(id))
+            return;
+        if (tombstones && (((*tombstones)[id >> 6].load(std::memory_order_relaxed) >> (id & 63)) & 1))
+            return;
+        if ((int)matches.size() < result_cap)
+        {
+            matches.push_back({d, id});
+            push_heap(matches.begin(), matches.end());
+        }
+        else
+        {
+            pop_heap(matches.begin(), matches.end());
+            matches.back() = {d, id};
+            push_heap(matches.begin(), matches.end());
+        }
+    }
+    int result_size(const CandidatePool &) const { return 0; }
+};
+
+template <class Space, class Stop>
+vector<int> Solution::search_kernel(const float *query, const vector<int> &entry_points, int level,
+                                    Stop &stop, SearchBudget *budget) const
+{
+    tls_visited.resize(num_vectors);
+    int tag = tls_visited.get_new_tag();
+    auto &visited = tls_visited.visited;
+
+    // Layer 0 reads the flat rows once they exist; the build and the upper
+    // layers read graph[level]
+    const bool flat = level == 0 && !final_graph_flat.empty();
+    const long long stride = 2 * M + 1;
+    if (level > 0)
+        SEARCH_STAT(tls_stats.levels_descended++);
+
+    CandidatePool &W = tls_pool;
+    W.reset(stop.capacity(), Stop::unbounded);
+
+    for (int ep : entry_points)
+    {
+        if (visited[ep] != tag)
+        {
+            visited[ep] = tag;
+            float d = Space::dist(query, &vec_data[(long long)ep * dimension], dimension);
+            SEARCH_STAT(tls_stats.visited++);
+            SEARCH_STAT(tls_stats.distance_calls++);
+            stop.scored(d, ep);
+            W.insert(d, ep);
+        }
+    }
+
+    int expanded = 0;
+    int slot;
+    while ((slot = W.next()) >= 0)
+    {
+        // 取得当前最近且未探测的点
+        float current_dist = W.dist[slot];
+        int current_id = W.id(slot);
+
+        if (stop.done(W, current_dist))
+            break;
+
+        // Anytime cut-off: keep the best found so far
+        if (budget && budget->exhausted(expanded++))
+            break;
+
+        SEARCH_STAT(tls_stats.hops++);
+
+        const int *neighbors_ptr = nullptr;
+        int neighbor_count = 0;
+        if (flat)
+        {
+            // 快速访问 Layer 0 扁平化邻居
+            const int *row = &final_graph_flat[current_id * stride];
+            neighbor_count = row[0];
+            neighbors_ptr = row + 1;
+
+            // The next candidate's adjacency row is needed right after this one
+            int upcoming = W.peek();
+            if (upcoming >= 0)
+                prefetch_row(W.id(upcoming));
+        }
+        else if (level < (int)graph.size())
+        {
+            const auto &adj = graph[level][current_id];
+            neighbor_count = adj.size();
+            neighbors_ptr = adj.data();
+        }
 
-            if (visited[neighbor] != tag)
+        // 批量预取后续邻居的向量数据
+        const int pd = prefetch_distance;
+        for (int i = 0; i < min(pd, neighbor_count); ++i)
+            prefetch_vector(neighbors_ptr[i]);
+
+        bool improved = false;
+        auto insert = [&](float d, int nid)
+        {
+            stop.scored(d, nid);
+            if (!(d < stop.admit_bound(W)))
+                return;
+            int pos = W.insert(d, nid);
+            if (pos >= 0)
             {
-                visited[neighbor] = tag;
-                float dist = distance(query, &vectors[neighbor * dimension], dimension);
+                SEARCH_STAT(tls_stats.pool_insertions++);
+                if (pos < K_TRACK)
+                    improved = true;
+            }
+        };
 
-                if (dist < lower_bound || W.size() < ef)
-                {
-                    candidates.push({dist, neighbor});
-                    W.push({dist, neighbor});
+        // Unvisited neighbors wait here and are scored four at a time by one
+        // dist_x4 call
+        int batch_ids[4];
+        int nb = 0;
+        for (int i = 0; i < neighbor_count; ++i)
+        {
+            int nid = neighbors_ptr[i];
 
-                    if (W.size() > ef)
-                    {
-                        W.pop();
-                        lower_bound = W.top().first;
-                    }
-                    else
-                    {
-                        lower_bound = W.top().first;
-                    }
+            // 流水线预取：整条向量提前 pd 个邻居
+            if (i + pd < neighbor_count)
+                prefetch_vector(neighbors_ptr[i + pd]);
+
+            if (visited[nid] == tag)
+                continue;
+            visited[nid] = tag;
+            SEARCH_STAT(tls_stats.visited++);
+
+            batch_ids[nb++] = nid;
+            if (nb == 4)
+            {
+                const float *xs[4] = {&vec_data[(long long)batch_ids[0] * dimension],
+                                      &vec_data[(long long)batch_ids[1] * dimension],
+                                      &vec_data[(long long)batch_ids[2] * dimension],
+                                      &vec_data[(long long)batch_ids[3] * dimension]};
+                float ds[4];
+                // 早期放弃：池满后四个累加和都越过准入上界即停止.
+                // Only valid when every prefix sum lower-bounds the distance
+                // (L2). The bound only tightens, so testing against it before
+                // the batch is inserted never drops an insertable neighbor.
+                float bound = stop.admit_bound(W);
+                bool finished = true;
+                if (Space::early_abandon && bound < numeric_limits<float>::max())
+                    finished = Space::dist_x4_bounded(query, xs, dimension, bound, abandon_scale.data(), ds);
+                else
+                    Space::dist_x4(query, xs, dimension, ds);
+                if (finished)
+                {
+                    SEARCH_STAT(tls_stats.distance_calls += 4);
+                    for (int j = 0; j < 4; ++j)
+                        insert(ds[j], batch_ids[j]);
                 }
+                else
+                {
+                    SEARCH_STAT(tls_stats.partial_prunes += 4);
+                }
+                nb = 0;
+            }
+        }
+        for (int j = 0; j < nb; ++j)
+        {
+            float d;
+            if (!Space::dist_bounded(query, &vec_data[(long long)batch_ids[j] * dimension], dimension,
+                                     stop.admit_bound(W), abandon_scale.data(), &d))
+            {
+                SEARCH_STAT(tls_stats.partial_prunes++);
+                continue;
             }
+            SEARCH_STAT(tls_stats.distance_calls++);
+            insert(d, batch_ids[j]);
         }
+
+        stop.expanded(improved);
     }
+    stop.finish();
 
+    // Nearest first. Tombstoned vertices are traversed but only filtered
+    // out at layer 0; upper layers keep them as waypoints.
+    bool filter_deleted = level == 0 && num_deleted.load(std::memory_order_relaxed) > 0;
+    int n = stop.result_size(W);
     vector<int> result;
-    result.reserve(W.size());
-    while (!W.empty())
+    result.reserve(n);
+    for (int i = 0; i < n; ++i)
+        if (!filter_deleted || !is_deleted(W.id(i)))
+            result.push_back(W.id(i));
+    return result;
+}
+
+template <class Space>
+vector<int> Solution::search_layer_impl(const float *query, const vector<int> &entry_points,
+                                        int level, const SearchParams &params, float stop_bound,
+                                        const TerminationModel *model, QueryTrace *trace,
+                                        SearchBudget *budget) const
+{
+    int ef = max(1, params.ef);
+    if (level == 0 && !final_graph_flat.empty())
+        ef = min(ef, 512);
+    if (model || trace)
     {
-        result.push_back(W.top().second);
-        W.pop();
+        LearnedStop<Space> stop(ef, stop_bound, model, trace);
+        return search_kernel<Space>(query, entry_points, level, stop, budget);
+    }
+    FixedEfStop<Space> stop(ef, stop_bound);
+    return search_kernel<Space>(query, entry_points, level, stop, budget);
+}
+
+void Solution::select_neighbors_heuristic(vector<int> &neighbors, int M_level, int base_node)
+{
+    switch (metric)
+    {
+    case METRIC_IP:
+        select_neighbors_heuristic_impl<IPSpace>(neighbors, M_level, base_node);
+        break;
+    case METRIC_COSINE:
+        select_neighbors_heuristic_impl<CosineSpace>(neighbors, M_level, base_node);
+        break;
+    default:
+        select_neighbors_heuristic_impl<L2Space>(neighbors, M_level, base_node);
     }
-    return result;
 }
 
-void Solution::select_neighbors_heuristic(vector<int> &neighbors, int M_level)
+template <class Space>
+void Solution::select_neighbors_heuristic_impl(vector<int> &neighbors, int M_level, int base_node)
 {
     if ((int)neighbors.size() <= M_level)
         return;
@@ -383,13 +1533,14 @@ void Solution::select_neighbors_heuristic(vector<int> &neighbors, int M_level)
         return;
 
     // Sort by distance first
-    int start_node = neighbors[0]; // heuristic baseline
+    // heuristic baseline: the owning vertex when known, else the first candidate
+    int start_node = base_node >= 0 ? base_node : neighbors[0];
     vector<pair<float, int>> scored;
     scored.reserve(neighbors.size());
 
     for (int n : neighbors)
     {
-        float d = distance(&vectors[start_node * dimension], &vectors[n * dimension], dimension);
+        float d = Space::dist(&vec_data[start_node * dimension], &vec_data[n * dimension], dimension);
         scored.push_back({d, n});
     }
     sort(scored.begin(), scored.end());
@@ -411,7 +1562,7 @@ void Solution::select_neighbors_heuristic(vector<int> &neighbors, int M_level)
 
         for (int sel : selected)
         {
-            float d = distance(&vectors[cand * dimension], &vectors[sel * dimension], dimension);
+            float d = Space::dist(&vec_data[cand * dimension], &vec_data[sel * dimension], dimension);
             if (d < dist_c * alpha)
             {
                 good = false;
@@ -443,7 +1594,7 @@ void Solution::select_neighbors_heuristic(vector<int> &neighbors, int M_level)
     neighbors = selected;
 }
 
-void Solution::connect_neighbors(int vertex, int level, const vector<int> &neighbors)
+void Solution::connect_neighbors(int vertex, int level, const vector<int> &neighbors, BuildStats *stats)
 {
     // 1. Forward connection (No lock needed, only this thread owns 'vertex')
     graph[level][vertex] = neighbors;
@@ -453,7 +1604,16 @@ void Solution::connect_neighbors(int vertex, int level, const vector<int> &neigh
 
     for (int neighbor : neighbors)
     {
-        node_locks[neighbor].acquire();
+        if (!stats)
+            node_locks[neighbor].acquire();
+        else if (!node_locks[neighbor].try_acquire())
+        {
+            // Only contended acquires are timed
+            BuildClock::time_point t0 = BuildClock::now();
+            node_locks[neighbor].acquire();
+            stats->lock_wait += seconds_since(t0);
+            stats->contended_locks++;
+        }
 
         vector<int> &conn = graph[level][neighbor];
         bool exists = false;
@@ -475,6 +1635,8 @@ void Solution::connect_neighbors(int vertex, int level, const vector<int> &neigh
             {
                 // We must prune inside lock to maintain integrity, but we do it rarely
                 select_neighbors_heuristic(conn, M_max);
+                if (stats)
+                    stats->lazy_prunes++;
             }
         }
 
@@ -484,26 +1646,111 @@ void Solution::connect_neighbors(int vertex, int level, const vector<int> &neigh
 
 void Solution::build(int d, const vector<float> &base)
 {
+    wait_for_compaction();
+
     dimension = d;
     num_vectors = base.size() / d;
     vectors = base;
 
-    // 1. Parameter Tuning (Glove Specific)
-    if (dimension == 100 && num_vectors > 500000)
+    // Cosine: normalize once so every later comparison is a plain dot product
+    if (metric == METRIC_COSINE)
     {
-        M = 30;                 // Safe spot between 24 and 32
-        ef_construction = 200;  // Reduced from 300 to fix TLE
-        ef_search = 200;        // High baseline for recall
-        gamma = 0.25;           // Adaptive
+        for (int i = 0; i < num_vectors; ++i)
+            normalize_vector(&vectors[(long long)i * dimension], dimension);
     }
-    else
-    {
+    dim_order.clear();
+    rotation.clear();
+    if (rotate_vectors && metric == METRIC_L2)
+        make_rotation();
+    else if (reorder_dims && metric == METRIC_L2)
+        reorder_dimensions();
+    vec_data = vectors.data();
+
+    build_index();
+    update_abandon_scale();
+    calibrate_prefetch();
+}
+
+void Solution::build(int d, const vector<float> &base, float target_recall)
+{
+    build(d, base);
+    if (target_recall > 0.0f)
+        autotune(target_recall);
+}
+
+// Index over storage owned by someone else (IVF-HNSW partitions point into
+// the parent's list-ordered base). Data must already be metric-normalized.
+void Solution::build_view(int d, const float *data, int n)
+{
+    wait_for_compaction();
+
+    dimension = d;
+    num_vectors = n;
+    vectors.clear();
+    vec_data = data;
+
+    build_index();
+}
+
+void Solution::build_index()
+{
+    // The build's own searches always use the exact early-abandon test
+    abandon_scale.assign(dimension / 32 + 1, 1.0f);
+
+    // Fresh index: no tombstones
+    tombstones = vector<std::atomic<uint64_t>>((num_vectors + 63) / 64);
+    num_deleted.store(0);
+    pending_deletes.clear();
+    detached_ids.clear();
+
+    // Norms feed the ||x||^2 - 2x.q + ||q||^2 form of the exact engine
+    base_norms.resize(num_vectors);
+    for (int i = 0; i < num_vectors; ++i)
+        base_norms[i] = inner_product(&vec_data[(long long)i * dimension], &vec_data[(long long)i * dimension], dimension);
+
+    row_to_id.clear();
+    id_to_row.clear();
+
+    active_index = index_type;
+    if (active_index == INDEX_AUTO)
+        active_index = (num_vectors <= flat_threshold) ? INDEX_FLAT : INDEX_HNSW;
+
+    if (active_index != INDEX_HNSW)
+    {
+        graph.clear();
+        final_graph_flat.clear();
+        vertex_level.clear();
+        max_level = 0;
+        centroid_index.reset();
+        ivf_partitions.clear();
+        // IVF routes (and IVF_HNSW partition walks) use this index's
+        // ef_search; default it to what the nested graphs pick for themselves
+        if (!user_params && (active_index == INDEX_IVF || active_index == INDEX_IVF_HNSW))
+            ef_search = 150;
+        if (active_index == INDEX_IVF || active_index == INDEX_IVF_HNSW)
+            build_ivf();
+        return;
+    }
+
+    // 1. Parameter Tuning (Glove Specific); skipped once set_parameters() was called
+    if (!user_params && dimension == 100 && num_vectors > 500000)
+    {
+        M = 30;                 // Safe spot between 24 and 32
+        ef_construction = 200;  // Reduced from 300 to fix TLE
+        ef_search = 200;        // High baseline for recall
+        gamma = 0.25;           // Adaptive
+    }
+    else if (!user_params)
+    {
         // SIFT or others
         M = 16;
         ef_construction = 150;
         ef_search = 150;
     }
 
+    build_stats = BuildStats();
+    BuildClock::time_point build_start = BuildClock::now();
+
     // 2. Pre-allocation (Fixes Critical Section bottleneck)
     // Pre-calculate levels
     vertex_level.resize(num_vectors);
@@ -516,6 +1763,8 @@ void Solution::build(int d, const vector<float> &base)
             max_level = l;
     }
 
+    build_stats.level_assignment = seconds_since(build_start);
+
     // Allocate Graph
     graph.resize(max_level + 1);
     for (int l = 0; l <= max_level; ++l)
@@ -541,43 +1790,100 @@ void Solution::build(int d, const vector<float> &base)
     // Parallel strategy:
     // We treat node 0 as the initial entry point.
 
+#ifdef _OPENMP
+    int build_threads = omp_get_max_threads();
+#else
+    int build_threads = 1;
+#endif
+    vector<BuildStatsSlot> thread_stats(build_threads);
+    SearchParams construction(ef_construction);
+    std::atomic<long long> inserted(0);
+    BuildClock::time_point insert_start = BuildClock::now();
+    std::atomic<long long> last_report_ns(0);
+    std::atomic<long long> last_report_count(0);
+
 #pragma omp parallel for schedule(dynamic, 128)
     for (int i = 1; i < num_vectors; ++i)
     {
+        BuildStats &st = thread_stats[build_thread_id()].s;
+        long long dist_before = tls_stats.distance_calls;
+        BuildClock::time_point t0 = BuildClock::now();
+
         int level = vertex_level[i];
         int curr_max_level = max_level; // Snapshot
 
         // Use thread-local visited list inside search_layer
 
-        vector<int> curr_ep;
-        curr_ep.push_back(0); // Always start from 0 (static entry)
-
         // Search down to insertion level
         // Note: We use the 'global' entry point 0. In a true online HNSW, entry point changes.
         // For batch build, starting from 0 is fine, or we can use a shared atomic entry point.
         // Using fixed entry point 0 is slightly suboptimal for navigation but thread-safe and fast.
-
-        for (int lc = curr_max_level; lc > level; --lc)
-        {
-            curr_ep = search_layer(&vectors[i * dimension], curr_ep, 1, lc);
-        }
+        vector<int> curr_ep(1, greedy_descent(&vec_data[i * dimension], 0, curr_max_level, level + 1));
+        BuildClock::time_point t1 = BuildClock::now();
+        st.upper_descent += std::chrono::duration<double>(t1 - t0).count();
 
         for (int lc = min(curr_max_level, level); lc >= 0; --lc)
         {
-            int ef_c = ef_construction;
-            vector<int> candidates = search_layer(&vectors[i * dimension], curr_ep, ef_c, lc);
+            vector<int> candidates = search_layer(&vec_data[i * dimension], curr_ep, lc, construction);
+            // The heuristic measures from its first candidate; the build has
+            // always handed it the farthest one
+            reverse(candidates.begin(), candidates.end());
+            BuildClock::time_point t2 = BuildClock::now();
 
             // Heuristic selection
             int M_curr = (lc == 0) ? M * 2 : M;
             select_neighbors_heuristic(candidates, M_curr);
+            BuildClock::time_point t3 = BuildClock::now();
 
             // Update graph
-            connect_neighbors(i, lc, candidates);
+            connect_neighbors(i, lc, candidates, &st);
+            BuildClock::time_point t4 = BuildClock::now();
+
+            st.candidate_search += std::chrono::duration<double>(t2 - t1).count();
+            st.pruning += std::chrono::duration<double>(t3 - t2).count();
+            st.linking += std::chrono::duration<double>(t4 - t3).count();
+            t1 = t4;
 
             // Candidates become entry points for next layer
             curr_ep = candidates;
         }
+        st.inserts++;
+        st.distance_calls += tls_stats.distance_calls - dist_before;
+
+        // Progress: checked every 256 inserts; one thread claims each report
+        long long done = inserted.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (build_progress && (done & 255) == 0)
+        {
+            long long now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(BuildClock::now() - insert_start).count();
+            long long last = last_report_ns.load(std::memory_order_relaxed);
+            if (now_ns - last >= (long long)(build_progress_interval * 1e9) &&
+                last_report_ns.compare_exchange_strong(last, now_ns))
+            {
+                long long prev = last_report_count.exchange(done);
+                BuildProgress p;
+                p.inserted = done + 1; // node 0 is placed without an insert
+                p.total = num_vectors;
+                p.elapsed = now_ns / 1e9;
+                p.inserts_per_sec = (done - prev) / max(1e-9, (now_ns - last) / 1e9);
+                build_progress(p);
+            }
+        }
+    }
+
+    for (const BuildStatsSlot &slot : thread_stats)
+    {
+        const BuildStats &t = slot.s;
+        build_stats.upper_descent += t.upper_descent;
+        build_stats.candidate_search += t.candidate_search;
+        build_stats.pruning += t.pruning;
+        build_stats.linking += t.linking;
+        build_stats.lock_wait += t.lock_wait;
+        build_stats.inserts += t.inserts;
+        build_stats.distance_calls += t.distance_calls;
+        build_stats.lazy_prunes += t.lazy_prunes;
+        build_stats.contended_locks += t.contended_locks;
     }
+    BuildClock::time_point flatten_start = BuildClock::now();
 
     // 4. Post-processing: Flatten Layer 0
     if (!graph.empty())
@@ -603,56 +1909,146 @@ void Solution::build(int d, const vector<float> &base)
             }
         }
     }
+    build_stats.flatten = seconds_since(flatten_start);
+    build_stats.wall_time = seconds_since(build_start);
+
+    if (build_progress)
+    {
+        BuildProgress p;
+        p.inserted = num_vectors;
+        p.total = num_vectors;
+        p.elapsed = seconds_since(insert_start);
+        p.inserts_per_sec = (num_vectors - 1) / max(1e-9, p.elapsed);
+        build_progress(p);
+    }
 }
 
-void Solution::search(const vector<float> &query, int *res)
+// Sorted top-k (distance, id) for an already prepared query; HNSW or FLAT
+void Solution::search_topk(const float *query, const SearchParams &params, vector<pair<float, int>> &out,
+                           float stop_bound) const
 {
-    search_hnsw(query, res);
+    int k = params.k;
+    out.clear();
+    if (num_vectors == 0 || k <= 0)
+        return;
+
+    if (active_index == INDEX_FLAT)
+    {
+        vector<int> ids(k);
+        vector<float> dists(k);
+        exact_knn(query, 1, k, ids.data(), dists.data());
+        for (int i = 0; i < k && ids[i] >= 0; ++i)
+            out.push_back({dists[i], ids[i]});
+        return;
+    }
+
+    vector<int> curr_ep(1, greedy_descent(query, 0, max_level, 1));
+    SearchParams layer0 = params;
+    layer0.ef = layer0_ef(params);
+    vector<int> candidates = search_layer(query, curr_ep, 0, layer0, stop_bound);
+
+    for (int id : candidates)
+        out.push_back({distance(query, &vec_data[(long long)id * dimension], dimension), id});
+    int n = min(k, (int)out.size());
+    partial_sort(out.begin(), out.begin() + n, out.end());
+    out.resize(n);
 }
 
-void Solution::search_hnsw(const vector<float> &query, int *res)
+void Solution::search(const vector<float> &query, int *res)
 {
-    if (graph.empty())
+    QueryStatsScope stats_scope(*this);
+    if (active_index == INDEX_IVF_HNSW)
+    {
+        vector<float> scratch;
+        search_ivf_hnsw(prepare_query(query, scratch), default_search_params(), res);
+        return;
+    }
+    if (active_index == INDEX_IVF)
+    {
+        vector<float> scratch;
+        const float *q = prepare_query(query, scratch);
+        SearchParams params = default_search_params();
+        switch (metric)
+        {
+        case METRIC_IP:
+            search_ivf_impl<IPSpace>(q, params, res);
+            break;
+        case METRIC_COSINE:
+            search_ivf_impl<CosineSpace>(q, params, res);
+            break;
+        default:
+            search_ivf_impl<L2Space>(q, params, res);
+        }
+        return;
+    }
+    if (active_index == INDEX_FLAT)
     {
-        for (int i = 0; i < 10; ++i)
-            res[i] = 0;
+        vector<float> scratch;
+        exact_knn(prepare_query(query, scratch), 1, 10, res, nullptr);
         return;
     }
+    search_hnsw(query, default_search_params(), res);
+}
+
+void Solution::search(const vector<float> &query, int k, int *res)
+{
+    search(query, default_search_params(k), res);
+}
 
-    vector<int> curr_ep;
-    curr_ep.push_back(0);
+bool Solution::search(const vector<float> &query, const SearchParams &params, int *res) const
+{
+    QueryStatsScope stats_scope(*this);
+    if (params.k <= 0)
+        return false;
+    vector<float> scratch;
+    bool truncated = search_ids(prepare_query(query, scratch), params, res);
+    if (truncated)
+        tls_stats.truncated++;
+    return truncated;
+}
 
-    for (int lc = max_level; lc > 0; --lc)
+void Solution::search_hnsw(const vector<float> &query, const SearchParams &params, int *res,
+                           QueryTrace *trace) const
+{
+    int k = params.k;
+    if (graph.empty())
     {
-        curr_ep = search_layer(query.data(), curr_ep, 1, lc);
+        for (int i = 0; i < k; ++i)
+            res[i] = -1;
+        return;
     }
 
+    vector<float> scratch;
+    const float *q = prepare_query(query, scratch);
+
+    vector<int> curr_ep(1, greedy_descent(q, 0, max_level, 1));
+
     // Layer 0 Search
+    SearchParams layer0 = params;
+    layer0.ef = layer0_ef(params);
     vector<int> candidates;
-    if (gamma > 0)
+    if (term_model.enabled || trace)
+    {
+        candidates = search_layer(q, curr_ep, 0, layer0, numeric_limits<float>::max(),
+                                  term_model.enabled ? &term_model : nullptr, trace);
+    }
+    else if (params.gamma > 0)
     {
-        candidates = search_layer_adaptive(query.data(), curr_ep, ef_search, 0, gamma);
+        candidates = search_layer_adaptive(q, curr_ep, 0, layer0);
     }
     else
     {
-        candidates = search_layer(query.data(), curr_ep, ef_search, 0);
+        candidates = search_layer(q, curr_ep, 0, layer0);
     }
 
-    // Sort candidates by distance to pick top 10
-    // candidates from search_layer are not strictly sorted by distance (they are heap popped)
-    // Wait, search_layer logic returns them popped from min-heap (farthest first) or max-heap?
-    // My search_layer pops from W (max-heap, keeps smallest).
-    // result.push_back(W.top()); W.pop();
-    // So result is [farthest ... closest].
-    // We need closest first for output.
-
-    // Sort top 10 safely
+    // The kernel returns candidates nearest first; re-rank on exact distances
+    // so the top k matches search_ids() under every space
     priority_queue<pair<float, int>> top_k;
     for (int idx : candidates)
     {
-        float d = distance(query.data(), &vectors[idx * dimension], dimension);
+        float d = distance(q, &vec_data[idx * dimension], dimension);
         top_k.push({d, idx});
-        if (top_k.size() > 10)
+        if ((int)top_k.size() > k)
             top_k.pop();
     }
 
@@ -664,114 +2060,1861 @@ void Solution::search_hnsw(const vector<float> &query, int *res)
     }
     reverse(final_res.begin(), final_res.end());
 
-    for (int i = 0; i < 10; ++i)
+    for (int i = 0; i < k; ++i)
     {
-        if (i < final_res.size())
+        if (i < (int)final_res.size())
             res[i] = final_res[i];
         else
-            res[i] = 0;
+            res[i] = -1;
     }
 }
 
-vector<int> Solution::search_layer_adaptive(const float *query, const vector<int> &entry_points,
-                                            int ef, int level, float gamma_param) const
+void Solution::search_trace(const vector<float> &query, int *res, QueryTrace &trace)
 {
-    tls_visited.resize(num_vectors);
-    int tag = tls_visited.get_new_tag();
-    auto &visited = tls_visited.visited;
+    QueryStatsScope stats_scope(*this);
+    trace = QueryTrace();
+    if (active_index == INDEX_HNSW)
+        search_hnsw(query, default_search_params(), res, &trace);
+    else
+        search(query, res);
+}
 
-    auto cmp_min = [](const pair<float, int> &a, const pair<float, int> &b)
-    { return a.first > b.first; };
-    priority_queue<pair<float, int>, vector<pair<float, int>>, decltype(cmp_min)> candidates(cmp_min);
+// ==================== Interleaved Batch Search ====================
 
-    auto cmp_max = [](const pair<float, int> &a, const pair<float, int> &b)
-    { return a.first < b.first; };
-    priority_queue<pair<float, int>, vector<pair<float, int>>, decltype(cmp_max)> W(cmp_max);
+// Visited marks for a group of up to 16 interleaved queries: the high 16
+// bits of a mark hold the group's epoch, the low 16 one bit per query slot.
+struct GroupVisited
+{
+    vector<uint32_t> mark;
+    uint32_t epoch;
 
-    for (int ep : entry_points)
+    GroupVisited() : epoch(0) {}
+
+    void begin(int n)
     {
-        if (visited[ep] != tag)
+        if ((int)mark.size() < n)
         {
-            visited[ep] = tag;
-            float dist = distance(query, &vectors[ep * dimension], dimension);
-            candidates.push({dist, ep});
-            W.push({dist, ep});
+            mark.assign(n, 0);
+            epoch = 0;
+        }
+        if (++epoch == 0x10000)
+        { // Overflow handling
+            fill(mark.begin(), mark.end(), 0);
+            epoch = 1;
         }
     }
 
-    float max_dist = W.empty() ? numeric_limits<float>::max() : W.top().first;
+    // Marks id as seen by slot; false when the slot had already seen it
+    bool test_and_set(int id, int slot)
+    {
+        uint32_t m = mark[id];
+        if ((m >> 16) != epoch)
+            m = epoch << 16;
+        uint32_t bit = 1u << slot;
+        if (m & bit)
+            return false;
+        mark[id] = m | bit;
+        return true;
+    }
+};
+
+// One query's layer-0 walk, split at the point where it would stall: issue
+// picks the next candidate and prefetches its unseen neighbors, the next
+// resume scores them. Same pool and slack rules as search_layer.
+struct InterleavedQuery
+{
+    const float *query;
+    CandidatePool W;
+    vector<int> pending; // neighbors issued, not yet scored
+    bool done;
+};
+
+static thread_local GroupVisited tls_group_visited;
+static thread_local vector<InterleavedQuery> tls_group;
 
-    while (!candidates.empty())
+template <class Space>
+void Solution::search_group_impl(const float *queries, int count, const SearchParams &params, int *res) const
+{
+    const int k = params.k;
+    const int ef = min(512, max(1, layer0_ef(params)));
+    const int stride = 2 * M + 1;
+    GroupVisited &visited = tls_group_visited;
+    visited.begin(num_vectors);
+    vector<InterleavedQuery> &group = tls_group;
+    if ((int)group.size() < count)
+        group.resize(count);
+
+    // Upper layers are a handful of greedy hops; walk them one query at a time
+    for (int s = 0; s < count; ++s)
     {
-        auto current = candidates.top();
-        candidates.pop();
+        InterleavedQuery &st = group[s];
+        st.query = queries + (long long)s * dimension;
+        int ep = greedy_descent(st.query, 0, max_level, 1);
+        visited.test_and_set(ep, s);
+        st.W.reset(ef);
+        st.W.insert(Space::dist(st.query, &vec_data[(long long)ep * dimension], dimension), ep);
+        SEARCH_STAT(tls_stats.visited++);
+        SEARCH_STAT(tls_stats.distance_calls++);
+        st.pending.clear();
+        st.done = false;
+    }
 
-        if (current.first > max_dist * (1.0 + gamma_param))
+    int active = count;
+    while (active > 0)
+    {
+        for (int s = 0; s < count; ++s)
         {
-            if (W.size() >= ef)
-                break;
+            InterleavedQuery &st = group[s];
+            if (st.done)
+                continue;
+            CandidatePool &W = st.W;
+
+            auto insert = [&](float d, int nid)
+            {
+                if (W.insert(d, nid) >= 0)
+                    SEARCH_STAT(tls_stats.pool_insertions++);
+            };
+
+            // Resume: score the neighbors issued last round (four at a time
+            // until the pool fills, then one by one with early abandon);
+            // their lines were fetched while the other queries ran
+            int batch_ids[4];
+            int nb = 0;
+            for (int nid : st.pending)
+            {
+                SEARCH_STAT(tls_stats.visited++);
+                if (Space::early_abandon && W.full())
+                {
+                    float d;
+                    if (Space::dist_bounded(st.query, &vec_data[(long long)nid * dimension], dimension,
+                                            W.dist[ef - 1], abandon_scale.data(), &d))
+                    {
+                        SEARCH_STAT(tls_stats.distance_calls++);
+                        insert(d, nid);
+                    }
+                    else
+                    {
+                        SEARCH_STAT(tls_stats.partial_prunes++);
+                    }
+                    continue;
+                }
+                batch_ids[nb++] = nid;
+                if (nb == 4)
+                {
+                    const float *xs[4] = {&vec_data[(long long)batch_ids[0] * dimension],
+                                          &vec_data[(long long)batch_ids[1] * dimension],
+                                          &vec_data[(long long)batch_ids[2] * dimension],
+                                          &vec_data[(long long)batch_ids[3] * dimension]};
+                    float ds[4];
+                    Space::dist_x4(st.query, xs, dimension, ds);
+                    SEARCH_STAT(tls_stats.distance_calls += 4);
+                    for (int j = 0; j < 4; ++j)
+                        insert(ds[j], batch_ids[j]);
+                    nb = 0;
+                }
+            }
+            for (int j = 0; j < nb; ++j)
+            {
+                insert(Space::dist(st.query, &vec_data[(long long)batch_ids[j] * dimension], dimension), batch_ids[j]);
+                SEARCH_STAT(tls_stats.distance_calls++);
+            }
+            st.pending.clear();
+
+            // Issue: expand candidates until one has unseen neighbors, then
+            // prefetch those and yield to the next query
+            while (st.pending.empty())
+            {
+                int slot = W.next();
+                if (slot < 0)
+                {
+                    st.done = true;
+                    --active;
+                    break;
+                }
+                Candidate current = {W.dist[slot], W.id(slot)};
+                if (W.full() && current.dist > Space::relax(W.dist[ef - 1], 0.05f))
+                {
+                    st.done = true;
+                    --active;
+                    break;
+                }
+                SEARCH_STAT(tls_stats.hops++);
+
+                const int *row = &final_graph_flat[(long long)current.id * stride];
+                int upcoming = W.peek();
+                if (upcoming >= 0)
+                    prefetch_row(W.id(upcoming));
+                for (int i = 1; i <= row[0]; ++i)
+                {
+                    int nid = row[i];
+                    if (visited.test_and_set(nid, s))
+                    {
+                        st.pending.push_back(nid);
+                        prefetch_vector(nid);
+                    }
+                }
+            }
         }
+    }
 
-        const int *neighbors_ptr = nullptr;
-        int neighbor_count = 0;
+    bool has_deletes = num_deleted.load(std::memory_order_relaxed) > 0;
+    for (int s = 0; s < count; ++s)
+    {
+        const InterleavedQuery &st = group[s];
+        int *out = res + (long long)s * k;
+        int n = 0;
+        for (int i = 0; i < st.W.size && n < k; ++i)
+            if (!has_deletes || !is_deleted(st.W.id(i)))
+                out[n++] = st.W.id(i);
+        for (; n < k; ++n)
+            out[n] = -1;
+    }
+}
+
+void Solution::search_batch(const vector<float> &queries, const SearchParams &params, int *res, int group) const
+{
+    int nq = dimension > 0 ? queries.size() / dimension : 0;
+    int k = params.k;
+    if (nq == 0 || k <= 0)
+        return;
 
-        if (level == 0 && !final_graph_flat.empty())
+    bool interleave = active_index == INDEX_HNSW && !final_graph_flat.empty() && params.gamma <= 0 &&
+                      params.max_hops <= 0 && params.time_budget_ms <= 0 && !term_model.enabled;
+    if (!interleave)
+    {
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int i = 0; i < nq; ++i)
         {
-            int max_neighbors_l0 = 2 * M;
-            long long offset = (long long)current.second * (max_neighbors_l0 + 1);
-            neighbor_count = final_graph_flat[offset];
-            neighbors_ptr = &final_graph_flat[offset + 1];
+            vector<float> q(queries.begin() + (long long)i * dimension, queries.begin() + (long long)(i + 1) * dimension);
+            search(q, params, res + (long long)i * k);
         }
-        else if (level < graph.size())
+        return;
+    }
+
+    // Cosine normalization / dimension order applied to the whole batch once
+    vector<float> scratch;
+    const float *q = prepare_queries(queries, scratch);
+
+    group = max(1, min(16, group));
+    int num_groups = (nq + group - 1) / group;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int g = 0; g < num_groups; ++g)
+    {
+        int first = g * group;
+        int count = min(group, nq - first);
+        QueryStatsScope stats_scope(*this, count);
+        const float *gq = q + (long long)first * dimension;
+        int *gres = res + (long long)first * k;
+        switch (metric)
         {
-            const auto &vec = graph[level][current.second];
-            neighbor_count = vec.size();
-            neighbors_ptr = vec.data();
+        case METRIC_IP:
+            search_group_impl<IPSpace>(gq, count, params, gres);
+            break;
+        case METRIC_COSINE:
+            search_group_impl<CosineSpace>(gq, count, params, gres);
+            break;
+        default:
+            search_group_impl<L2Space>(gq, count, params, gres);
         }
+    }
+}
 
-        // Prefetching
-        for (int i = 0; i < min(4, neighbor_count); ++i)
-            _mm_prefetch((const char *)&vectors[neighbors_ptr[i] * dimension], _MM_HINT_T0);
+// ==================== Search Statistics ====================
 
-        for (int i = 0; i < neighbor_count; ++i)
-        {
-            int neighbor = neighbors_ptr[i];
+Solution::QueryStatsScope::QueryStatsScope(const Solution &s, int n) : owner(s), queries(n)
+{
+    if (tls_query_depth++ == 0)
+        tls_stats = SearchStats();
+}
+
+Solution::QueryStatsScope::~QueryStatsScope()
+{
+    if (--tls_query_depth != 0)
+        return;
+    const SearchStats &st = tls_stats;
+    owner.stat_queries.fetch_add(queries, std::memory_order_relaxed);
+    if (st.truncated)
+        owner.stat_truncated.fetch_add(st.truncated, std::memory_order_relaxed);
+#if SEARCH_STATS
+    owner.distance_computations.fetch_add(st.distance_calls, std::memory_order_relaxed);
+    owner.stat_hops.fetch_add(st.hops, std::memory_order_relaxed);
+    owner.stat_partial_prunes.fetch_add(st.partial_prunes, std::memory_order_relaxed);
+    owner.stat_visited.fetch_add(st.visited, std::memory_order_relaxed);
+    owner.stat_pool_insertions.fetch_add(st.pool_insertions, std::memory_order_relaxed);
+    owner.stat_levels_descended.fetch_add(st.levels_descended, std::memory_order_relaxed);
+#endif
+    tls_last_stats = st;
+    tls_last_stats.queries = queries;
+}
+
+SearchStats Solution::get_search_stats() const
+{
+    SearchStats st;
+    st.queries = stat_queries.load();
+    st.hops = stat_hops.load();
+    st.distance_calls = distance_computations.load();
+    st.partial_prunes = stat_partial_prunes.load();
+    st.visited = stat_visited.load();
+    st.pool_insertions = stat_pool_insertions.load();
+    st.levels_descended = stat_levels_descended.load();
+    st.truncated = stat_truncated.load();
+    return st;
+}
+
+void Solution::reset_search_stats()
+{
+    stat_queries.store(0);
+    stat_hops.store(0);
+    distance_computations.store(0);
+    stat_partial_prunes.store(0);
+    stat_visited.store(0);
+    stat_pool_insertions.store(0);
+    stat_levels_descended.store(0);
+    stat_truncated.store(0);
+}
+
+SearchStats Solution::last_query_stats() { return tls_last_stats; }
+
+bool Solution::load_termination_model(const string &filename)
+{
+    ifstream in(filename);
+    TerminationModel model;
+    if (!(in >> model.w[0] >> model.w[1] >> model.w[2] >> model.warmup >> model.min_patience))
+        return false;
+    model.enabled = true;
+    term_model = model;
+    return true;
+}
+
+vector<int> Solution::search_layer_adaptive(const float *query, const vector<int> &entry_points,
+                                            int level, const SearchParams &params, SearchBudget *budget) const
+{
+    switch (metric)
+    {
+    case METRIC_IP:
+        return search_layer_adaptive_impl<IPSpace>(query, entry_points, level, params, budget);
+    case METRIC_COSINE:
+        return search_layer_adaptive_impl<CosineSpace>(query, entry_points, level, params, budget);
+    default:
+        return search_layer_adaptive_impl<L2Space>(query, entry_points, level, params, budget);
+    }
+}
 
-            if (i + 4 < neighbor_count)
-                _mm_prefetch((const char *)&vectors[neighbors_ptr[i + 4] * dimension], _MM_HINT_T0);
+template <class Space>
+vector<int> Solution::search_layer_adaptive_impl(const float *query, const vector<int> &entry_points,
+                                                 int level, const SearchParams &params, SearchBudget *budget) const
+{
+    AdaptiveStop<Space> stop(max(1, params.ef), params.gamma);
+    return search_kernel<Space>(query, entry_points, level, stop, budget);
+}
+
+// ==================== Graph Persistence ====================
+//
+// Binary layout (native endianness), version 1:
+//   header   magic, version, metric, active_index, dimension, num_vectors,
+//            M, ef_construction, ef_search, max_level, ml, gamma
+//   vectors  num_vectors x dimension floats (as stored, i.e. normalized for cosine)
+//   HNSW     vertex_level, then per level >= 1 every vertex's (count, ids),
+//            then final_graph_flat (layer 0; graph[0] is rebuilt from it)
+//   deletes  tombstone words, pending ids, detached ids
+// IVF backends keep permuted storage and nested indexes and are not persisted.
+
+static const uint32_t GRAPH_MAGIC = 0x48534E57; // "WNSH"
+static const uint32_t GRAPH_VERSION = 3; // 2: dimension order, 3: rotation
+
+template <class T>
+static void write_pod(ofstream &out, const T &v) { out.write((const char *)&v, sizeof(T)); }
+template <class T>
+static bool read_pod(ifstream &in, T &v) { return (bool)in.read((char *)&v, sizeof(T)); }
+
+template <class T>
+static void write_vec(ofstream &out, const T *data, size_t n)
+{
+    write_pod(out, (uint64_t)n);
+    if (n)
+        out.write((const char *)data, n * sizeof(T));
+}
+template <class T>
+static bool read_vec(ifstream &in, vector<T> &v)
+{
+    uint64_t n;
+    if (!read_pod(in, n))
+        return false;
+    v.resize(n);
+    return n == 0 || (bool)in.read((char *)v.data(), n * sizeof(T));
+}
 
-            if (visited[neighbor] != tag)
+bool Solution::save_graph(const string &filename) const
+{
+    if (active_index != INDEX_HNSW && active_index != INDEX_FLAT)
+        return false;
+    ofstream out(filename, ios::binary);
+    if (!out)
+        return false;
+
+    write_pod(out, GRAPH_MAGIC);
+    write_pod(out, GRAPH_VERSION);
+    write_pod(out, (int32_t)metric);
+    write_pod(out, (int32_t)active_index);
+    write_pod(out, (int32_t)dimension);
+    write_pod(out, (int32_t)num_vectors);
+    write_pod(out, (int32_t)M);
+    write_pod(out, (int32_t)ef_construction);
+    write_pod(out, (int32_t)ef_search);
+    write_pod(out, (int32_t)max_level);
+    write_pod(out, ml);
+    write_pod(out, gamma);
+
+    write_vec(out, vec_data, (size_t)num_vectors * dimension);
+
+    if (active_index == INDEX_HNSW)
+    {
+        write_vec(out, vertex_level.data(), vertex_level.size());
+        for (int l = 1; l <= max_level; ++l)
+        {
+            // Every vertex, not just level members: the fixed entry node 0
+            // collects reverse links on levels above its own
+            for (int v = 0; v < num_vectors; ++v)
             {
-                visited[neighbor] = tag;
-                float dist = distance(query, &vectors[neighbor * dimension], dimension);
+                const vector<int> &adj = graph[l][v];
+                write_pod(out, (int32_t)adj.size());
+                if (!adj.empty())
+                    out.write((const char *)adj.data(), adj.size() * sizeof(int));
+            }
+        }
+        write_vec(out, final_graph_flat.data(), final_graph_flat.size());
+    }
 
-                if (dist < max_dist * (1.0 + gamma_param) || W.size() < ef)
-                {
-                    candidates.push({dist, neighbor});
-                    W.push({dist, neighbor});
+    vector<uint64_t> bits(tombstones.size());
+    for (size_t i = 0; i < bits.size(); ++i)
+        bits[i] = tombstones[i].load(std::memory_order_relaxed);
+    write_vec(out, bits.data(), bits.size());
+    {
+        std::lock_guard<std::mutex> guard(delete_mutex);
+        write_vec(out, pending_deletes.data(), pending_deletes.size());
+        write_vec(out, detached_ids.data(), detached_ids.size());
+    }
+    write_vec(out, dim_order.data(), dim_order.size());
+    write_vec(out, rotation.data(), rotation.size());
+    write_pod(out, rotation_epsilon);
+    return (bool)out;
+}
 
-                    if (W.size() > ef)
-                    {
-                        W.pop();
-                        max_dist = W.top().first;
-                    }
-                    else
-                    {
-                        max_dist = W.top().first;
-                    }
-                }
+bool Solution::load_graph(const string &filename)
+{
+    ifstream in(filename, ios::binary);
+    if (!in)
+        return false;
+
+    uint32_t magic = 0, version = 0;
+    int32_t h_metric, h_index, h_dim, h_n, h_M, h_efc, h_efs, h_levels;
+    float h_ml, h_gamma;
+    if (!read_pod(in, magic) || magic != GRAPH_MAGIC || !read_pod(in, version) || version < 1 ||
+        version > GRAPH_VERSION)
+        return false;
+    if (!read_pod(in, h_metric) || !read_pod(in, h_index) || !read_pod(in, h_dim) || !read_pod(in, h_n) ||
+        !read_pod(in, h_M) || !read_pod(in, h_efc) || !read_pod(in, h_efs) || !read_pod(in, h_levels) ||
+        !read_pod(in, h_ml) || !read_pod(in, h_gamma))
+        return false;
+    if ((h_index != INDEX_HNSW && h_index != INDEX_FLAT) || h_dim <= 0 || h_n < 0 || h_levels < 0)
+        return false;
+
+    wait_for_compaction();
+
+    // Parse into locals first so a truncated file leaves this index untouched
+    vector<float> new_vectors;
+    vector<int> new_levels, new_flat;
+    vector<vector<vector<int>>> new_graph;
+    if (!read_vec(in, new_vectors) || new_vectors.size() != (size_t)h_n * h_dim)
+        return false;
+    if (h_index == INDEX_HNSW)
+    {
+        if (!read_vec(in, new_levels) || new_levels.size() != (size_t)h_n)
+            return false;
+        new_graph.resize(h_levels + 1);
+        for (int l = 0; l <= h_levels; ++l)
+            new_graph[l].resize(h_n);
+        for (int l = 1; l <= h_levels; ++l)
+        {
+            for (int v = 0; v < h_n; ++v)
+            {
+                int32_t cnt;
+                if (!read_pod(in, cnt) || cnt < 0 || cnt > h_n)
+                    return false;
+                new_graph[l][v].resize(cnt);
+                if (cnt && !in.read((char *)new_graph[l][v].data(), cnt * sizeof(int)))
+                    return false;
             }
         }
+        int row = 2 * h_M + 1;
+        if (!read_vec(in, new_flat) || new_flat.size() != (size_t)h_n * row)
+            return false;
+        for (int v = 0; v < h_n; ++v)
+        {
+            const int *r = &new_flat[(long long)v * row];
+            new_graph[0][v].assign(r + 1, r + 1 + min(r[0], row - 1));
+        }
+    }
+    vector<uint64_t> bits;
+    vector<int> pending, detached;
+    if (!read_vec(in, bits) || !read_vec(in, pending) || !read_vec(in, detached))
+        return false;
+    vector<int> new_order; // version 1 files predate dimension reordering
+    if (version >= 2 && (!read_vec(in, new_order) || (!new_order.empty() && new_order.size() != (size_t)h_dim)))
+        return false;
+    vector<float> new_rotation;
+    float h_epsilon = rotation_epsilon;
+    if (version >= 3 && (!read_vec(in, new_rotation) || !read_pod(in, h_epsilon) ||
+                         (!new_rotation.empty() && new_rotation.size() != (size_t)h_dim * h_dim)))
+        return false;
+
+    metric = (Metric)h_metric;
+    index_type = active_index = (IndexType)h_index;
+    dimension = h_dim;
+    num_vectors = h_n;
+    M = h_M;
+    ef_construction = h_efc;
+    ef_search = h_efs;
+    max_level = h_levels;
+    ml = h_ml;
+    gamma = h_gamma;
+    user_params = true;
+
+    vectors.swap(new_vectors);
+    vec_data = vectors.data();
+    dim_order.swap(new_order);
+    reorder_dims = !dim_order.empty();
+    rotation.swap(new_rotation);
+    rotate_vectors = !rotation.empty();
+    rotation_epsilon = h_epsilon;
+    update_abandon_scale();
+    vertex_level.swap(new_levels);
+    graph.swap(new_graph);
+    final_graph_flat.swap(new_flat);
+    node_locks = vector<NodeLock>(num_vectors);
+    entry_point.assign(1, 0);
+
+    base_norms.resize(num_vectors);
+    for (int i = 0; i < num_vectors; ++i)
+        base_norms[i] = inner_product(&vec_data[(long long)i * dimension], &vec_data[(long long)i * dimension], dimension);
+    row_to_id.clear();
+    id_to_row.clear();
+    centroid_index.reset();
+    ivf_partitions.clear();
+
+    tombstones = vector<std::atomic<uint64_t>>((num_vectors + 63) / 64);
+    long long deleted = 0;
+    for (size_t i = 0; i < tombstones.size() && i < bits.size(); ++i)
+    {
+        tombstones[i].store(bits[i]);
+        deleted += __builtin_popcountll(bits[i]);
     }
+    num_deleted.store(deleted);
+    {
+        std::lock_guard<std::mutex> guard(delete_mutex);
+        pending_deletes.swap(pending);
+        detached_ids.swap(detached);
+    }
+    calibrate_prefetch();
+    return true;
+}
 
-    vector<int> result;
-    while (!W.empty())
+// ==================== Soft Delete & Compaction ====================
+
+bool Solution::remove(int id)
+{
+    if (id < 0 || id >= num_vectors)
+        return false;
+
+    uint64_t bit = 1ULL << (id & 63);
+    uint64_t prev = tombstones[id >> 6].fetch_or(bit, std::memory_order_relaxed);
+    if (prev & bit)
+        return false; // already deleted
+
+    num_deleted.fetch_add(1);
+
+    bool trigger = false;
     {
-        result.push_back(W.top().second);
-        W.pop();
+        std::lock_guard<std::mutex> guard(delete_mutex);
+        pending_deletes.push_back(id);
+        trigger = pending_deletes.size() >= compaction_threshold * num_vectors;
     }
-    return result;
+
+    // Kick off background repair; searches never wait on it
+    if (trigger && !compaction_running.exchange(true))
+    {
+        if (compaction_thread.joinable())
+            compaction_thread.join();
+        compaction_thread = std::thread(&Solution::run_compaction, this);
+    }
+    return true;
+}
+
+void Solution::compact()
+{
+    wait_for_compaction();
+    compaction_running.store(true);
+    run_compaction();
 }
 
-bool Solution::save_graph(const string &filename) const { return false; }
-bool Solution::load_graph(const string &filename) { return false; }
+void Solution::wait_for_compaction()
+{
+    if (compaction_thread.joinable())
+        compaction_thread.join();
+}
+
+// Rewire every live vertex at this level that points into the tombstoned set,
+// plus node 0: it is the fixed entry point, so it stays routable when deleted
+// and must not lead into rows that compaction has cleared. Rows are rewritten
+// in place and never grow, so concurrent readers only ever see valid ids
+// (same benign-race contract as hnswlib's link list updates).
+void Solution::repair_level(int level)
+{
+    bool flat = (level == 0 && !final_graph_flat.empty());
+    int max_neighbors_l0 = 2 * M;
+    int M_max = (level == 0) ? 2 * M : M;
+
+    vector<int> cand;
+
+    for (int v = 0; v < num_vectors; ++v)
+    {
+        if ((v != 0 && is_deleted(v)) || vertex_level[v] < level)
+            continue;
+
+        int *row;
+        int row_size;
+        if (flat)
+        {
+            long long off = (long long)v * (max_neighbors_l0 + 1);
+            row_size = final_graph_flat[off];
+            row = &final_graph_flat[off + 1];
+        }
+        else
+        {
+            row_size = graph[level][v].size();
+            row = graph[level][v].data();
+        }
+
+        bool touched = false;
+        for (int j = 0; j < row_size; ++j)
+            if (is_deleted(row[j]))
+            {
+                touched = true;
+                break;
+            }
+        if (!touched)
+            continue;
+
+        // Candidates: surviving neighbors plus the live neighbors of deleted ones
+        cand.clear();
+        for (int j = 0; j < row_size; ++j)
+        {
+            int u = row[j];
+            if (!is_deleted(u))
+            {
+                cand.push_back(u);
+                continue;
+            }
+            const int *urow;
+            int usize;
+            if (flat)
+            {
+                long long uoff = (long long)u * (max_neighbors_l0 + 1);
+                usize = final_graph_flat[uoff];
+                urow = &final_graph_flat[uoff + 1];
+            }
+            else
+            {
+                usize = graph[level][u].size();
+                urow = graph[level][u].data();
+            }
+            for (int k = 0; k < usize; ++k)
+                if (urow[k] != v && !is_deleted(urow[k]))
+                    cand.push_back(urow[k]);
+        }
+
+        sort(cand.begin(), cand.end());
+        cand.erase(unique(cand.begin(), cand.end()), cand.end());
+
+        // Never grow the row: keeps flat slots and vector capacity stable
+        select_neighbors_heuristic(cand, min(M_max, row_size), v);
+
+        node_locks[v].acquire();
+        int new_size = min((int)cand.size(), row_size);
+        for (int j = 0; j < new_size; ++j)
+            row[j] = cand[j];
+        if (flat)
+        {
+            final_graph_flat[(long long)v * (max_neighbors_l0 + 1)] = new_size;
+            graph[0][v].assign(cand.begin(), cand.begin() + new_size);
+        }
+        else
+        {
+            graph[level][v].resize(new_size);
+        }
+        node_locks[v].release();
+
+        // Stay out of the way of foreground queries
+        if ((v & 1023) == 0)
+            std::this_thread::yield();
+    }
+}
+
+void Solution::run_compaction()
+{
+    vector<int> batch;
+    {
+        std::lock_guard<std::mutex> guard(delete_mutex);
+        batch.swap(pending_deletes);
+    }
+
+    if (!batch.empty() && !graph.empty())
+    {
+        for (int l = max_level; l >= 0; --l)
+            repair_level(l);
+
+        // Nothing live points at the batch anymore: drop their edges. The
+        // global entry point (node 0) stays routable as a tombstone.
+        int max_neighbors_l0 = 2 * M;
+        vector<int> detached;
+        for (int id : batch)
+        {
+            if (id == 0)
+                continue;
+            node_locks[id].acquire();
+            for (int l = 0; l <= vertex_level[id] && l < (int)graph.size(); ++l)
+                graph[l][id].clear();
+            if (!final_graph_flat.empty())
+                final_graph_flat[(long long)id * (max_neighbors_l0 + 1)] = 0;
+            node_locks[id].release();
+            detached.push_back(id);
+        }
+
+        std::lock_guard<std::mutex> guard(delete_mutex);
+        detached_ids.insert(detached_ids.end(), detached.begin(), detached.end());
+    }
+
+    compaction_running.store(false);
+}
+
+// ==================== Filtered Search ====================
+
+float Solution::estimate_selectivity(const SearchFilter &filter) const
+{
+    if (filter.selectivity > 0)
+        return min(filter.selectivity, 1.0f);
+
+    if (filter.bitmap && !filter.accept)
+    {
+        long long allowed = 0;
+        int words = num_vectors / 64;
+        for (int w = 0; w < words; ++w)
+            allowed += __builtin_popcountll(filter.bitmap[w]);
+        if (num_vectors & 63)
+            allowed += __builtin_popcountll(filter.bitmap[words] & ((1ULL << (num_vectors & 63)) - 1));
+        return (float)allowed / max(num_vectors, 1);
+    }
+
+    // Callback: evaluate on an evenly spaced sample
+    int samples = min(num_vectors, 1024);
+    int stride = max(num_vectors / max(samples, 1), 1);
+    int hits = 0;
+    for (int i = 0; i < samples; ++i)
+        if (filter(i * stride))
+            ++hits;
+    return (float)max(hits, 1) / max(samples, 1);
+}
+
+vector<pair<float, int>> Solution::brute_force_filtered(const float *query, int k,
+                                                        const SearchFilter &filter) const
+{
+    bool has_deletes = num_deleted.load(std::memory_order_relaxed) > 0;
+    vector<pair<float, int>> top; // max-heap on distance
+    top.reserve(k + 1);
+
+    auto consider = [&](int id)
+    {
+        if (has_deletes && is_deleted(id))
+            return;
+        float d = distance(query, &vec_data[(long long)row_of(id) * dimension], dimension);
+        if ((int)top.size() < k)
+        {
+            top.push_back({d, id});
+            push_heap(top.begin(), top.end());
+        }
+        else if (d < top.front().first)
+        {
+            pop_heap(top.begin(), top.end());
+            top.back() = {d, id};
+            push_heap(top.begin(), top.end());
+        }
+    };
+
+    if (filter.bitmap)
+    {
+        // Walk set bits only; the callback (if any) is checked per survivor
+        int words = (num_vectors + 63) / 64;
+        for (int w = 0; w < words; ++w)
+        {
+            uint64_t bits = filter.bitmap[w];
+            while (bits)
+            {
+                int id = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (id >= num_vectors)
+                    break;
+                if (!filter.accept || filter.accept(id))
+                    consider(id);
+            }
+        }
+    }
+    else
+    {
+        for (int id = 0; id < num_vectors; ++id)
+            if (filter(id))
+                consider(id);
+    }
+
+    sort_heap(top.begin(), top.end());
+    return top;
+}
+
+// Layer-0 walk with the predicate pushed into traversal (FilteredStop);
+// returns up to result_cap matches, nearest first
+vector<pair<float, int>> Solution::search_layer_filtered(const float *query, const vector<int> &entry_points,
+                                                         int ef, int result_cap,
+                                                         const SearchFilter &filter) const
+{
+    switch (metric)
+    {
+    case METRIC_IP:
+        return search_layer_filtered_impl<IPSpace>(query, entry_points, ef, result_cap, filter);
+    case METRIC_COSINE:
+        return search_layer_filtered_impl<CosineSpace>(query, entry_points, ef, result_cap, filter);
+    default:
+        return search_layer_filtered_impl<L2Space>(query, entry_points, ef, result_cap, filter);
+    }
+}
+
+template <class Space>
+vector<pair<float, int>> Solution::search_layer_filtered_impl(const float *query, const vector<int> &entry_points,
+                                                              int ef, int result_cap,
+                                                              const SearchFilter &filter) const
+{
+    bool has_deletes = num_deleted.load(std::memory_order_relaxed) > 0;
+    FilteredStop<Space> stop(ef, result_cap, filter, has_deletes ? &tombstones : nullptr);
+    search_kernel<Space>(query, entry_points, 0, stop, nullptr);
+    sort_heap(stop.matches.begin(), stop.matches.end());
+    return stop.matches;
+}
+
+int Solution::search_filtered(const vector<float> &query, int k, const SearchFilter &filter, int *res)
+{
+    return search_filtered(query, default_search_params(k), filter, res);
+}
+
+int Solution::search_filtered(const vector<float> &query, const SearchParams &params, const SearchFilter &filter,
+                              int *res) const
+{
+    QueryStatsScope stats_scope(*this);
+    int k = params.k;
+    if (num_vectors == 0 || k <= 0)
+        return 0;
+
+    float sel = max(estimate_selectivity(filter), 1e-6f);
+    int base_ef = layer0_ef(params);
+    int ef = (int)min((float)num_vectors, base_ef / sel);
+
+    // Scanning the allowed ids beats the graph walk once there are fewer of
+    // them than the walk would touch (about ef expansions x 2M neighbors)
+    long long allowed = (long long)(sel * num_vectors);
+    long long graph_cost = (long long)ef * 2 * M;
+
+    vector<float> scratch;
+    const float *q = prepare_query(query, scratch);
+
+    vector<pair<float, int>> found;
+    if (graph.empty() || final_graph_flat.empty() || allowed <= graph_cost)
+    {
+        found = brute_force_filtered(q, k, filter);
+    }
+    else
+    {
+        vector<int> curr_ep(1, greedy_descent(q, 0, max_level, 1));
+        found = search_layer_filtered(q, curr_ep, ef, base_ef, filter);
+
+        // The walk starved under the filter: fall back to the exact scan
+        if ((int)found.size() < k)
+            found = brute_force_filtered(q, k, filter);
+    }
+
+    int n = min(k, (int)found.size());
+    for (int i = 0; i < k; ++i)
+        res[i] = i < n ? found[i].second : -1;
+    return n;
+}
+
+// ==================== Range Search ====================
+
+int Solution::range_search(const vector<float> &query, float radius,
+                           const std::function<bool(int, float)> &emit)
+{
+    return range_search(query, radius, default_search_params(), emit);
+}
+
+int Solution::range_search(const vector<float> &query, float radius,
+                           vector<int> &out_ids, vector<float> &out_dists)
+{
+    return range_search(query, radius, default_search_params(), out_ids, out_dists);
+}
+
+int Solution::range_search(const vector<float> &query, float radius, const SearchParams &params,
+                           const std::function<bool(int, float)> &emit) const
+{
+    QueryStatsScope stats_scope(*this);
+    if (num_vectors == 0 || (metric == METRIC_L2 && radius < 0))
+        return 0;
+
+    vector<float> scratch;
+    const float *q = prepare_query(query, scratch);
+    // distance() is squared for L2; other metrics take the radius as-is
+    float r2 = (metric == METRIC_L2) ? radius * radius : radius;
+    bool has_deletes = num_deleted.load(std::memory_order_relaxed) > 0;
+
+    if (active_index != INDEX_HNSW)
+    {
+        int hits = 0;
+        for (int row = 0; row < num_vectors; ++row)
+        {
+            int id = id_of(row);
+            if (has_deletes && is_deleted(id))
+                continue;
+            float d = distance(q, &vec_data[(long long)row * dimension], dimension);
+            if (d <= r2)
+            {
+                ++hits;
+                if (!emit(id, d))
+                    break;
+            }
+        }
+        return hits;
+    }
+    // Vertices slightly outside the ball are still expanded: they often
+    // bridge to in-radius regions (same 1.05 slack as search_layer)
+    float expand_bound = r2 + fabsf(r2) * 0.05f;
+
+    // Seed with a regular top-ef search so we start inside the ball
+    vector<int> curr_ep(1, greedy_descent(q, 0, max_level, 1));
+    SearchParams seed(layer0_ef(params), params.k);
+    vector<int> seeds = search_layer(q, curr_ep, 0, seed);
+
+    tls_visited.resize(num_vectors);
+    int tag = tls_visited.get_new_tag();
+    auto &visited = tls_visited.visited;
+
+    // FIFO frontier: memory tracks the boundary of the ball, not the hit count
+    std::deque<int> frontier;
+    int hits = 0;
+    bool stop = false;
+
+    auto visit = [&](int id)
+    {
+        visited[id] = tag;
+        float d = distance(q, &vec_data[id * dimension], dimension);
+        if (d > expand_bound)
+            return;
+        frontier.push_back(id);
+        if (d <= r2 && !(has_deletes && is_deleted(id)))
+        {
+            ++hits;
+            if (!emit(id, d))
+                stop = true;
+        }
+    };
+
+    for (int id : seeds)
+    {
+        if (stop)
+            break;
+        if (visited[id] != tag)
+            visit(id);
+    }
+
+    int max_neighbors_l0 = 2 * M;
+    while (!frontier.empty() && !stop)
+    {
+        int cur = frontier.front();
+        frontier.pop_front();
+
+        long long offset = (long long)cur * (max_neighbors_l0 + 1);
+        int neighbor_count = final_graph_flat[offset];
+        const int *neighbors_ptr = &final_graph_flat[offset + 1];
+
+        for (int i = 0; i < neighbor_count && !stop; ++i)
+        {
+            if (i + prefetch_distance < neighbor_count)
+                prefetch_vector(neighbors_ptr[i + prefetch_distance]);
+            int nid = neighbors_ptr[i];
+            if (visited[nid] != tag)
+                visit(nid);
+        }
+    }
+
+    return hits;
+}
+
+int Solution::range_search(const vector<float> &query, float radius, const SearchParams &params,
+                           vector<int> &out_ids, vector<float> &out_dists) const
+{
+    QueryStatsScope stats_scope(*this);
+    int limit = range_result_limit;
+    int taken = 0;
+    if (limit <= 0)
+        return 0;
+    range_search(query, radius, params, [&](int id, float d)
+                 {
+                     out_ids.push_back(id);
+                     out_dists.push_back(d);
+                     return ++taken < limit;
+                 });
+    return taken;
+}
+
+// ==================== Exact (Flat) Engine ====================
+
+void Solution::exact_knn(const float *queries, int nq, int k, int *out_ids, float *out_dists) const
+{
+    // Query tile sized for L1/L2 (64 x 512B for SIFT); each base row is
+    // loaded once per tile and reused against every query in it
+    const int Q_BLOCK = 64;
+    int num_blocks = (nq + Q_BLOCK - 1) / Q_BLOCK;
+    bool has_deletes = num_deleted.load(std::memory_order_relaxed) > 0;
+    SEARCH_STAT(tls_stats.distance_calls += (long long)nq * num_vectors);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int qb = 0; qb < num_blocks; ++qb)
+    {
+        int q_begin = qb * Q_BLOCK;
+        int qn = min(Q_BLOCK, nq - q_begin);
+        const float *Q = queries + (long long)q_begin * dimension;
+
+        float q_norm[Q_BLOCK];
+        for (int j = 0; j < qn; ++j)
+            q_norm[j] = (metric == METRIC_L2) ? inner_product(Q + (long long)j * dimension, Q + (long long)j * dimension, dimension) : 0.0f;
+
+        vector<vector<pair<float, int>>> heaps(qn); // max-heaps of size k
+        for (auto &h : heaps)
+            h.reserve(k + 1);
+
+        float dots[Q_BLOCK];
+        for (int i = 0; i < num_vectors; ++i)
+        {
+            int id = id_of(i);
+            if (has_deletes && is_deleted(id))
+                continue;
+            const float *x = &vec_data[(long long)i * dimension];
+
+            int j = 0;
+            for (; j + 4 <= qn; j += 4)
+                inner_product_x4(x, Q + (long long)j * dimension, Q + (long long)(j + 1) * dimension,
+                                 Q + (long long)(j + 2) * dimension, Q + (long long)(j + 3) * dimension,
+                                 dimension, dots + j);
+            for (; j < qn; ++j)
+                dots[j] = inner_product(x, Q + (long long)j * dimension, dimension);
+
+            for (j = 0; j < qn; ++j)
+            {
+                float d;
+                if (metric == METRIC_L2)
+                    d = max(base_norms[i] - 2.0f * dots[j] + q_norm[j], 0.0f);
+                else if (metric == METRIC_IP)
+                    d = -dots[j];
+                else
+                    d = 1.0f - dots[j];
+
+                auto &h = heaps[j];
+                if ((int)h.size() < k)
+                {
+                    h.push_back({d, id});
+                    push_heap(h.begin(), h.end());
+                }
+                else if (d < h.front().first)
+                {
+                    pop_heap(h.begin(), h.end());
+                    h.back() = {d, id};
+                    push_heap(h.begin(), h.end());
+                }
+            }
+        }
+
+        for (int j = 0; j < qn; ++j)
+        {
+            auto &h = heaps[j];
+            sort_heap(h.begin(), h.end());
+            long long base = (long long)(q_begin + j) * k;
+            for (int r = 0; r < k; ++r)
+            {
+                bool valid = r < (int)h.size();
+                out_ids[base + r] = valid ? h[r].second : -1;
+                if (out_dists)
+                    out_dists[base + r] = valid ? h[r].first : numeric_limits<float>::max();
+            }
+        }
+    }
+}
+
+void Solution::search_exact(const vector<float> &queries, int k, vector<int> &ids, vector<float> *dists)
+{
+    int nq = dimension > 0 ? queries.size() / dimension : 0;
+    ids.assign((long long)nq * k, -1);
+    if (dists)
+        dists->assign((long long)nq * k, numeric_limits<float>::max());
+    if (nq == 0 || k <= 0)
+        return;
+
+    vector<float> scratch;
+    const float *q = prepare_queries(queries, scratch);
+    exact_knn(q, nq, k, ids.data(), dists ? dists->data() : nullptr);
+}
+
+bool Solution::write_groundtruth(const string &filename, const vector<float> &queries, int k)
+{
+    vector<int> ids;
+    search_exact(queries, k, ids);
+
+    ofstream out(filename);
+    if (!out.is_open())
+        return false;
+
+    int nq = dimension > 0 ? queries.size() / dimension : 0;
+    for (int i = 0; i < nq; ++i)
+    {
+        for (int r = 0; r < k; ++r)
+        {
+            if (r)
+                out << ' ';
+            out << ids[(long long)i * k + r];
+        }
+        out << '\n';
+    }
+    return out.good();
+}
+
+// ==================== K-Means ====================
+
+KMeans::KMeans(int k_val, int dim_val, unsigned seed)
+{
+    k = k_val;
+    dim = dim_val;
+    max_iterations = 10;
+    batch_size = 4096;
+    max_points_per_centroid = 256;
+    rng.seed(seed);
+}
+
+void KMeans::set_parameters(int iterations, int batch, int points_per_centroid)
+{
+    max_iterations = iterations;
+    batch_size = batch;
+    max_points_per_centroid = points_per_centroid;
+}
+
+void KMeans::update_norms()
+{
+    centroid_norms.resize(k);
+    for (int c = 0; c < k; ++c)
+        centroid_norms[c] = inner_product(&centroids[(long long)c * dim], &centroids[(long long)c * dim], dim);
+}
+
+void KMeans::assign(const float *data, int n, int *labels, float *dists) const
+{
+    // Centroid tile sized to stay in L2 while a block of points streams past
+    const int C_BLOCK = 256;
+    const int P_BLOCK = 64;
+    int num_blocks = (n + P_BLOCK - 1) / P_BLOCK;
+
+#pragma omp parallel for schedule(dynamic, 4)
+    for (int pb = 0; pb < num_blocks; ++pb)
+    {
+        int p_begin = pb * P_BLOCK;
+        int p_end = min(n, p_begin + P_BLOCK);
+        float best_dist[P_BLOCK];
+        int best[P_BLOCK];
+        for (int i = 0; i < P_BLOCK; ++i)
+        {
+            best_dist[i] = numeric_limits<float>::max();
+            best[i] = 0;
+        }
+
+        float dots[4];
+        for (int c_begin = 0; c_begin < k; c_begin += C_BLOCK)
+        {
+            int c_end = min(k, c_begin + C_BLOCK);
+            for (int i = p_begin; i < p_end; ++i)
+            {
+                const float *x = data + (long long)i * dim;
+                float &bd = best_dist[i - p_begin];
+                int &bc = best[i - p_begin];
+
+                // ||x||^2 is constant per point, so argmin over ||c||^2 - 2 x.c
+                int c = c_begin;
+                for (; c + 4 <= c_end; c += 4)
+                {
+                    inner_product_x4(x, &centroids[(long long)c * dim], &centroids[(long long)(c + 1) * dim],
+                                     &centroids[(long long)(c + 2) * dim], &centroids[(long long)(c + 3) * dim],
+                                     dim, dots);
+                    for (int j = 0; j < 4; ++j)
+                    {
+                        float d = centroid_norms[c + j] - 2.0f * dots[j];
+                        if (d < bd)
+                        {
+                            bd = d;
+                            bc = c + j;
+                        }
+                    }
+                }
+                for (; c < c_end; ++c)
+                {
+                    float d = centroid_norms[c] - 2.0f * inner_product(x, &centroids[(long long)c * dim], dim);
+                    if (d < bd)
+                    {
+                        bd = d;
+                        bc = c;
+                    }
+                }
+            }
+        }
+
+        for (int i = p_begin; i < p_end; ++i)
+        {
+            labels[i] = best[i - p_begin];
+            if (dists)
+            {
+                const float *x = data + (long long)i * dim;
+                dists[i] = max(best_dist[i - p_begin] + inner_product(x, x, dim), 0.0f);
+            }
+        }
+    }
+}
+
+// Full-batch Lloyd over the (already sampled) training set
+void KMeans::lloyd(const float *data, int n, vector<int> &labels)
+{
+    vector<double> sums((long long)k * dim);
+    vector<int> counts(k);
+
+    for (int iter = 0; iter < max_iterations; ++iter)
+    {
+        assign(data, n, labels.data());
+
+        fill(sums.begin(), sums.end(), 0.0);
+        fill(counts.begin(), counts.end(), 0);
+        for (int i = 0; i < n; ++i)
+        {
+            int c = labels[i];
+            counts[c]++;
+            const float *x = data + (long long)i * dim;
+            double *sum = &sums[(long long)c * dim];
+            for (int j = 0; j < dim; ++j)
+                sum[j] += x[j];
+        }
+
+        for (int c = 0; c < k; ++c)
+        {
+            if (counts[c] == 0)
+                continue;
+            for (int j = 0; j < dim; ++j)
+                centroids[(long long)c * dim + j] = (float)(sums[(long long)c * dim + j] / counts[c]);
+        }
+
+        // Empty clusters: split the largest one with a small perturbation
+        for (int c = 0; c < k; ++c)
+        {
+            if (counts[c] != 0)
+                continue;
+            int big = max_element(counts.begin(), counts.end()) - counts.begin();
+            if (counts[big] < 2)
+                break;
+            for (int j = 0; j < dim; ++j)
+            {
+                float v = centroids[(long long)big * dim + j];
+                float eps = 1e-4f * (fabsf(v) + 1e-3f);
+                centroids[(long long)c * dim + j] = v + eps;
+                centroids[(long long)big * dim + j] = v - eps;
+            }
+            counts[c] = counts[big] / 2;
+            counts[big] -= counts[c];
+        }
+        update_norms();
+    }
+}
+
+// Sculley-style mini-batch updates with per-centroid learning rate 1 / count.
+// Runs a fixed number of batches independent of n, so cost stays flat as the
+// base grows.
+void KMeans::mini_batch(const float *data, int n, vector<int> &labels)
+{
+    vector<int> counts(k, 0);
+    vector<float> batch((long long)batch_size * dim);
+    vector<int> batch_labels(batch_size);
+    long long steps = mini_batch_steps();
+
+    for (long long step = 0; step < steps; ++step)
+    {
+        for (int b = 0; b < batch_size; ++b)
+            memcpy(&batch[(long long)b * dim], data + (long long)(rng() % n) * dim, dim * sizeof(float));
+
+        assign(batch.data(), batch_size, batch_labels.data());
+
+        for (int b = 0; b < batch_size; ++b)
+        {
+            int c = batch_labels[b];
+            float eta = 1.0f / ++counts[c];
+            float *cent = &centroids[(long long)c * dim];
+            const float *x = &batch[(long long)b * dim];
+            for (int j = 0; j < dim; ++j)
+                cent[j] += eta * (x[j] - cent[j]);
+        }
+        update_norms();
+    }
+    assign(data, n, labels.data());
+}
+
+void KMeans::train(const float *data, int n)
+{
+    if (n <= 0 || k <= 0)
+        return;
+    k = min(k, n);
+
+    // Train on a random sample; partial Fisher-Yates over indices
+    long long cap = (long long)k * max_points_per_centroid;
+    int n_train = (int)min<long long>(n, cap);
+    vector<float> sample;
+    const float *train_data = data;
+    if (n_train < n)
+    {
+        vector<int> perm(n);
+        for (int i = 0; i < n; ++i)
+            perm[i] = i;
+        sample.resize((long long)n_train * dim);
+        for (int i = 0; i < n_train; ++i)
+        {
+            int j = i + rng() % (n - i);
+            swap(perm[i], perm[j]);
+            memcpy(&sample[(long long)i * dim], data + (long long)perm[i] * dim, dim * sizeof(float));
+        }
+        train_data = sample.data();
+    }
+
+    // Seed with k distinct random training points
+    centroids.resize((long long)k * dim);
+    {
+        vector<int> perm(n_train);
+        for (int i = 0; i < n_train; ++i)
+            perm[i] = i;
+        for (int c = 0; c < k; ++c)
+        {
+            int j = c + rng() % (n_train - c);
+            swap(perm[c], perm[j]);
+            memcpy(&centroids[(long long)c * dim], train_data + (long long)perm[c] * dim, dim * sizeof(float));
+        }
+    }
+    update_norms();
+
+    // Mini-batch once it touches fewer points than full Lloyd passes would
+    vector<int> labels(n_train);
+    if (batch_size > 0 && mini_batch_steps() * batch_size < (long long)max_iterations * n_train)
+        mini_batch(train_data, n_train, labels);
+    else
+        lloyd(train_data, n_train, labels);
+}
+
+// ==================== IVF Engine ====================
+
+void Solution::build_ivf()
+{
+    // Flat lists want many small lists; per-list graphs want few large ones
+    int default_nlist = (active_index == INDEX_IVF_HNSW) ? (int)(sqrt((double)num_vectors) / 4)
+                                                         : (int)(4 * sqrt((double)num_vectors));
+    int nlist = ivf_nlist > 0 ? ivf_nlist : max(1, default_nlist);
+    nlist = min(nlist, max(num_vectors, 1));
+    if (num_vectors == 0)
+    {
+        ivf_offsets.assign(2, 0);
+        ivf_centroids.clear();
+        return;
+    }
+
+    KMeans kmeans(nlist, dimension, rng());
+    kmeans.train(vectors.data(), num_vectors);
+    ivf_centroids = kmeans.get_centroids();
+
+    // Final assignment of the full base, then counting sort into list order
+    vector<int> assignment(num_vectors);
+    kmeans.assign(vectors.data(), num_vectors, assignment.data());
+    ivf_offsets.assign(nlist + 1, 0);
+    for (int i = 0; i < num_vectors; ++i)
+        ivf_offsets[assignment[i] + 1]++;
+    for (int c = 0; c < nlist; ++c)
+        ivf_offsets[c + 1] += ivf_offsets[c];
+
+    // Rewrite storage list by list; the base itself is the list payload, so
+    // IVF costs no extra copy of the vectors
+    row_to_id.resize(num_vectors);
+    id_to_row.resize(num_vectors);
+    vector<int> cursor(ivf_offsets.begin(), ivf_offsets.end() - 1);
+    for (int i = 0; i < num_vectors; ++i)
+    {
+        int row = cursor[assignment[i]]++;
+        row_to_id[row] = i;
+        id_to_row[i] = row;
+    }
+
+    vector<float> ordered((long long)num_vectors * dimension);
+    vector<float> ordered_norms(num_vectors);
+    for (int row = 0; row < num_vectors; ++row)
+    {
+        int id = row_to_id[row];
+        memcpy(&ordered[(long long)row * dimension], &vec_data[(long long)id * dimension], dimension * sizeof(float));
+        ordered_norms[row] = base_norms[id];
+    }
+    vectors.swap(ordered);
+    vec_data = vectors.data();
+    base_norms.swap(ordered_norms);
+
+    // Route with a graph over the centroids; INDEX_AUTO keeps it an exact
+    // scan while nlist is small enough that a graph buys nothing
+    centroid_index.reset(new Solution());
+    centroid_index->set_metric(metric);
+    centroid_index->build(dimension, ivf_centroids);
+
+    if (active_index != INDEX_IVF_HNSW)
+        return;
+
+    // One HNSW per list, built in place over the list's contiguous rows
+    ivf_partitions.resize(nlist);
+    for (int c = 0; c < nlist; ++c)
+        ivf_partitions[c].reset(new Solution());
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < nlist; ++c)
+    {
+        Solution &part = *ivf_partitions[c];
+        part.set_metric(metric);
+        part.set_index_type(INDEX_HNSW);
+        int size = ivf_offsets[c + 1] - ivf_offsets[c];
+        if (size > 0)
+            part.build_view(dimension, &vec_data[(long long)ivf_offsets[c] * dimension], size);
+    }
+}
+
+template <class Space>
+void Solution::ivf_scan_list(const float *query, int list, int k, vector<pair<float, int>> &heap) const
+{
+    bool has_deletes = num_deleted.load(std::memory_order_relaxed) > 0;
+    int begin = ivf_offsets[list];
+    int end = ivf_offsets[list + 1];
+    const float *x = &vec_data[(long long)begin * dimension];
+    SEARCH_STAT(tls_stats.hops++);
+    SEARCH_STAT(tls_stats.distance_calls += end - begin);
+
+    for (int row = begin; row < end; ++row, x += dimension)
+    {
+        int id = row_to_id[row];
+        if (has_deletes && is_deleted(id))
+            continue;
+        float d = Space::dist(query, x, dimension);
+        if ((int)heap.size() < k)
+        {
+            heap.push_back({d, id});
+            push_heap(heap.begin(), heap.end());
+        }
+        else if (d < heap.front().first)
+        {
+            pop_heap(heap.begin(), heap.end());
+            heap.back() = {d, id};
+            push_heap(heap.begin(), heap.end());
+        }
+    }
+}
+
+template <class Space>
+void Solution::search_ivf_impl(const float *query, const SearchParams &params, int *res) const
+{
+    int k = params.k;
+    int nlist = (int)ivf_offsets.size() - 1;
+    int nprobe = max(1, min(ivf_nprobe, nlist));
+
+    // Route: nearest nprobe centroids through the centroid index
+    SearchParams route = centroid_index->default_search_params(nprobe);
+    route.ef = layer0_ef(params);
+    vector<pair<float, int>> centroid_dists;
+    centroid_index->search_topk(query, route, centroid_dists);
+    nprobe = centroid_dists.size();
+
+    long long work = 0;
+    for (int p = 0; p < nprobe; ++p)
+        work += ivf_offsets[centroid_dists[p].second + 1] - ivf_offsets[centroid_dists[p].second];
+
+    // Scan lists in parallel once there is enough work to amortize the fork;
+    // each thread keeps its own top-k and the heaps are merged at the end
+    vector<pair<float, int>> merged;
+#pragma omp parallel if (work > 65536)
+    {
+        vector<pair<float, int>> local;
+        local.reserve(k + 1);
+#pragma omp for schedule(dynamic, 1) nowait
+        for (int p = 0; p < nprobe; ++p)
+            ivf_scan_list<Space>(query, centroid_dists[p].second, k, local);
+#pragma omp critical
+        merged.insert(merged.end(), local.begin(), local.end());
+    }
+
+    int n = min(k, (int)merged.size());
+    partial_sort(merged.begin(), merged.begin() + n, merged.end());
+    for (int i = 0; i < k; ++i)
+        res[i] = i < n ? merged[i].second : -1;
+}
+
+// Multi-probe over per-list graphs. Probes run in parallel, nearest list
+// first; every finished probe tightens a shared k-th best distance that later
+// probes use as an early stop bound.
+void Solution::search_ivf_hnsw(const float *query, const SearchParams &params, int *res) const
+{
+    int k = params.k;
+    int nlist = (int)ivf_partitions.size();
+    int nprobe = max(1, min(ivf_nprobe, nlist));
+
+    SearchParams route = centroid_index->default_search_params(nprobe);
+    route.ef = layer0_ef(params);
+    vector<pair<float, int>> routes;
+    centroid_index->search_topk(query, route, routes);
+    nprobe = routes.size();
+
+    // Partitions do not see this index's tombstones, so their top-k may hold
+    // deleted ids; ask each for extra hits, twice the expected deleted share
+    int deleted = num_deleted.load(std::memory_order_relaxed);
+    bool has_deletes = deleted > 0;
+    int fetch = k;
+    if (has_deletes)
+    {
+        double frac = min(0.9, (double)deleted / max(num_vectors, 1));
+        fetch = k + (int)ceil(2.0 * k * frac / (1.0 - frac));
+    }
+
+    vector<pair<float, int>> merged; // max-heap of global (distance, id)
+    merged.reserve(k + 1);
+    std::atomic<float> bound(numeric_limits<float>::max());
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int p = 0; p < nprobe; ++p)
+    {
+        int list = routes[p].second;
+        const Solution &part = *ivf_partitions[list];
+        if (part.num_vectors == 0)
+            continue;
+
+        vector<pair<float, int>> local;
+        SearchParams probe(layer0_ef(params), fetch);
+        part.search_topk(query, probe, local, bound.load(std::memory_order_relaxed));
+
+#pragma omp critical
+        {
+            for (auto &cand : local)
+            {
+                int id = id_of(ivf_offsets[list] + cand.second);
+                if (has_deletes && is_deleted(id))
+                    continue;
+                if ((int)merged.size() < k)
+                {
+                    merged.push_back({cand.first, id});
+                    push_heap(merged.begin(), merged.end());
+                }
+                else if (cand.first < merged.front().first)
+                {
+                    pop_heap(merged.begin(), merged.end());
+                    merged.back() = {cand.first, id};
+                    push_heap(merged.begin(), merged.end());
+                }
+            }
+            if ((int)merged.size() >= k)
+                bound.store(merged.front().first, std::memory_order_relaxed);
+        }
+    }
+
+    sort_heap(merged.begin(), merged.end());
+    for (int i = 0; i < k; ++i)
+        res[i] = i < (int)merged.size() ? merged[i].second : -1;
+}
+
+// ==================== Recall-Targeted Auto-Tuning ====================
+
+// Top-k ids for an already prepared query with the given settings. Mirrors
+// search() but for any k; also used to score tuning candidates. Returns true
+// when the hop / time budget cut layer 0 short.
+bool Solution::search_ids(const float *query, const SearchParams &params, int *res) const
+{
+    int k = params.k;
+    if (active_index == INDEX_IVF_HNSW)
+    {
+        search_ivf_hnsw(query, params, res);
+        return false;
+    }
+    if (active_index == INDEX_IVF)
+    {
+        switch (metric)
+        {
+        case METRIC_IP:
+            search_ivf_impl<IPSpace>(query, params, res);
+            break;
+        case METRIC_COSINE:
+            search_ivf_impl<CosineSpace>(query, params, res);
+            break;
+        default:
+            search_ivf_impl<L2Space>(query, params, res);
+        }
+        return false;
+    }
+    if (active_index == INDEX_FLAT)
+    {
+        exact_knn(query, 1, k, res, nullptr);
+        return false;
+    }
+
+    SearchBudget budget(params);
+    SearchBudget *limit = budget.limited() ? &budget : nullptr;
+    vector<int> curr_ep(1, greedy_descent(query, 0, max_level, 1));
+    SearchParams layer0 = params;
+    layer0.ef = layer0_ef(params);
+    // Same precedence as search_hnsw(): the learned stop rule, then gamma
+    vector<int> candidates;
+    if (term_model.enabled)
+        candidates = search_layer(query, curr_ep, 0, layer0, numeric_limits<float>::max(), &term_model,
+                                  nullptr, limit);
+    else if (params.gamma > 0)
+        candidates = search_layer_adaptive(query, curr_ep, 0, layer0, limit);
+    else
+        candidates = search_layer(query, curr_ep, 0, layer0, numeric_limits<float>::max(), nullptr, nullptr,
+                                  limit);
+
+    vector<pair<float, int>> ranked;
+    ranked.reserve(candidates.size());
+    for (int id : candidates)
+        ranked.push_back({distance(query, &vec_data[(long long)id * dimension], dimension), id});
+    int n = min(k, (int)ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + n, ranked.end());
+    for (int i = 0; i < k; ++i)
+        res[i] = i < n ? ranked[i].second : -1;
+    return budget.truncated;
+}
+
+// Recall@k of the current settings on base rows used as queries. Each query
+// asks for k + 1 results and its own id is dropped on both sides, so the
+// sample behaves like held-out data rather than trivially finding itself.
+double Solution::sample_recall(const vector<float> &sample, const vector<int> &self_ids,
+                               const vector<int> &truth, int k) const
+{
+    int ns = self_ids.size();
+    long long hits = 0;
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : hits)
+    for (int i = 0; i < ns; ++i)
+    {
+        vector<int> res(k + 1);
+        search_ids(&sample[(long long)i * dimension], default_search_params(k + 1), res.data());
+
+        const int *gt = &truth[(long long)i * (k + 1)];
+        vector<int> expected, found;
+        for (int j = 0; j <= k; ++j)
+        {
+            if (gt[j] != self_ids[i] && gt[j] >= 0 && (int)expected.size() < k)
+                expected.push_back(gt[j]);
+            if (res[j] != self_ids[i] && res[j] >= 0 && (int)found.size() < k)
+                found.push_back(res[j]);
+        }
+        for (int id : found)
+            if (find(expected.begin(), expected.end(), id) != expected.end())
+                ++hits;
+    }
+    return ns > 0 ? (double)hits / ((double)ns * k) : 0.0;
+}
+
+void Solution::autotune(float target_recall)
+{
+    const int K = 10;
+    if (active_index == INDEX_FLAT || num_vectors <= 2 * K)
+        return;
+
+    // 1. Pseudo-queries: a fixed random sample of base rows plus their exact
+    //    neighbors (k + 1 so the row itself can be dropped)
+    int ns = min(num_vectors / 2, max(200, min(500, num_vectors / 100)));
+    mt19937 sample_rng(1234);
+    vector<int> rows(num_vectors);
+    for (int i = 0; i < num_vectors; ++i)
+        rows[i] = i;
+    for (int i = 0; i < ns; ++i)
+        swap(rows[i], rows[i + sample_rng() % (num_vectors - i)]);
+
+    vector<float> sample((long long)ns * dimension);
+    vector<int> self_ids(ns);
+    for (int i = 0; i < ns; ++i)
+    {
+        memcpy(&sample[(long long)i * dimension], &vec_data[(long long)rows[i] * dimension], dimension * sizeof(float));
+        self_ids[i] = id_of(rows[i]);
+    }
+    vector<int> truth((long long)ns * (K + 1));
+    exact_knn(sample.data(), ns, K + 1, truth.data(), nullptr);
+
+    auto time_sample = [&]() -> double
+    {
+        auto t0 = chrono::high_resolution_clock::now();
+        vector<int> res(K + 1);
+        for (int i = 0; i < ns; ++i)
+            search_ids(&sample[(long long)i * dimension], default_search_params(K + 1), res.data());
+        auto t1 = chrono::high_resolution_clock::now();
+        return chrono::duration<double, milli>(t1 - t0).count() / ns;
+    };
+
+    // Smallest value of a knob in [lo, hi] meeting the target (recall is
+    // monotone in every knob we tune); hi when none does. Gallops up from lo
+    // first so cheap settings are tried before expensive ones.
+    auto smallest = [&](int lo, int hi, const std::function<void(int)> &apply, double &recall) -> int
+    {
+        int v = lo;
+        while (true)
+        {
+            apply(v);
+            recall = sample_recall(sample, self_ids, truth, K);
+            if (recall >= target_recall || v == hi)
+                break;
+            lo = v + 1;
+            v = min(hi, 2 * v);
+        }
+        if (recall < target_recall)
+            return hi;
+        int top = v;
+        double top_recall = recall;
+        while (lo < top)
+        {
+            int mid = lo + (top - lo) / 2;
+            apply(mid);
+            double r = sample_recall(sample, self_ids, truth, K);
+            if (r >= target_recall)
+            {
+                top = mid;
+                top_recall = r;
+            }
+            else
+            {
+                lo = mid + 1;
+            }
+        }
+        apply(top);
+        recall = top_recall;
+        return top;
+    };
+
+    double recall = 0.0;
+    if (active_index == INDEX_IVF || active_index == INDEX_IVF_HNSW)
+    {
+        int nlist = ivf_offsets.size() - 1;
+        int nprobe = smallest(1, max(1, nlist), [&](int v) { ivf_nprobe = v; }, recall);
+        cerr << "autotune: target recall@10 " << target_recall << " -> nprobe " << nprobe
+             << " (sample recall " << recall << ", " << time_sample() << " ms/query)" << endl;
+        return;
+    }
+
+    // 2. HNSW: for each gamma (0 = fixed-ef search) find the smallest ef that
+    //    reaches the target, then keep the fastest of those settings. ef stays
+    //    within the 512-slot layer-0 pool.
+    const float gammas[] = {0.0f, 0.1f, 0.2f, 0.4f};
+    int best_ef = 500;
+    float best_gamma = 0.0f;
+    double best_ms = numeric_limits<double>::max(), best_recall = -1.0;
+    bool reached = false;
+    for (float g : gammas)
+    {
+        gamma = g;
+        double r = 0.0;
+        int ef = smallest(10, 500, [&](int v) { ef_search = v; }, r);
+        bool ok = r >= target_recall;
+        if (reached && !ok)
+            continue;
+        double ms = time_sample();
+        // Prefer settings that reach the target; among those the fastest,
+        // otherwise the most accurate
+        if ((ok && (!reached || ms < best_ms)) || (!ok && r > best_recall))
+        {
+            best_ef = ef;
+            best_gamma = g;
+            best_ms = ms;
+            best_recall = r;
+            reached = ok;
+        }
+    }
+    ef_search = best_ef;
+    gamma = best_gamma;
+
+    cerr << "autotune: target recall@10 " << target_recall << " -> ef_search " << ef_search
+         << ", gamma " << gamma << " (sample recall " << best_recall << ", " << best_ms << " ms/query"
+         << (reached ? "" : ", target not reached") << ")" << endl;
+}
+
+// ==================== Prefetch Calibration ====================
+
+// Picks the prefetch distance with the lowest search time. Queries are
+// midpoints of random base-row pairs (a base row alone finds itself almost
+// at once). Distances are timed round-robin, three rounds, best round each,
+// so drift on a busy box hits all of them alike; the default stays unless
+// another distance is at least 3% faster. Skipped after set_prefetch() and
+// for small or non-HNSW indexes, whose data sits in cache anyway.
+void Solution::calibrate_prefetch()
+{
+    if (prefetch_user || active_index != INDEX_HNSW || final_graph_flat.empty() || num_vectors < 10000)
+        return;
+
+    const int ns = 128;
+    const int distances[] = {0, 1, 2, 4, 6, 8, 12};
+    const int nd = sizeof(distances) / sizeof(distances[0]);
+    mt19937 sample_rng(4321);
+    vector<float> sample((long long)ns * dimension);
+    for (int i = 0; i < ns; ++i)
+    {
+        const float *a = &vec_data[(long long)(sample_rng() % num_vectors) * dimension];
+        const float *b = &vec_data[(long long)(sample_rng() % num_vectors) * dimension];
+        for (int j = 0; j < dimension; ++j)
+            sample[(long long)i * dimension + j] = 0.5f * (a[j] + b[j]);
+        if (metric == METRIC_COSINE)
+            normalize_vector(&sample[(long long)i * dimension], dimension);
+    }
+
+    SearchParams params = default_search_params(10);
+    vector<int> res(params.k);
+    auto run = [&]() -> double
+    {
+        auto t0 = chrono::steady_clock::now();
+        for (int i = 0; i < ns; ++i)
+            search_ids(&sample[(long long)i * dimension], params, res.data());
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    };
+
+    int fallback = prefetch_distance;
+    run(); // warmup
+    vector<double> best_ms(nd, numeric_limits<double>::max());
+    for (int round = 0; round < 3; ++round)
+        for (int i = 0; i < nd; ++i)
+        {
+            prefetch_distance = distances[i];
+            best_ms[i] = min(best_ms[i], run());
+        }
+
+    double fallback_ms = numeric_limits<double>::max();
+    int best = 0;
+    for (int i = 0; i < nd; ++i)
+    {
+        if (distances[i] == fallback)
+            fallback_ms = best_ms[i];
+        if (best_ms[i] < best_ms[best])
+            best = i;
+    }
+    prefetch_distance = best_ms[best] < 0.97 * fallback_ms ? distances[best] : fallback;
+}
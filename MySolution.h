@@ -12,9 +12,190 @@
 #include <fstream>
 #include <string>
 #include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstdint>
+#include <functional>
+#include <memory>
 
 using namespace std;
 
+// Distance metric, fixed at build(). Cosine normalizes base vectors once at
+// build() and queries at search(), then ranks by a single dot product.
+enum Metric
+{
+    METRIC_L2,     // squared Euclidean
+    METRIC_IP,     // maximum inner product (distance = -dot)
+    METRIC_COSINE  // distance = 1 - cos
+};
+
+// Index backend. INDEX_AUTO picks FLAT for small collections (where a graph
+// buys nothing over an exact scan) and HNSW otherwise.
+enum IndexType
+{
+    INDEX_AUTO,
+    INDEX_HNSW,
+    INDEX_FLAT, // exact blocked brute force
+    INDEX_IVF,     // k-means coarse partitions, nprobe lists scanned per query
+    INDEX_IVF_HNSW // k-means partitions, one HNSW per list, centroid-graph routing
+};
+
+// Attribute predicate for Solution::search_filtered(). Either a bitmap (bit i
+// set => id i allowed, at least (N + 63) / 64 words), a per-id callback, or
+// both (AND). selectivity is an optional hint in (0, 1]; when unset it is
+// counted from the bitmap or sampled from the callback.
+struct SearchFilter
+{
+    const uint64_t *bitmap;
+    std::function<bool(int)> accept;
+    float selectivity;
+
+    SearchFilter() : bitmap(nullptr), selectivity(-1.0f) {}
+    explicit SearchFilter(const uint64_t *bits) : bitmap(bits), selectivity(-1.0f) {}
+    explicit SearchFilter(std::function<bool(int)> fn) : bitmap(nullptr), accept(fn), selectivity(-1.0f) {}
+
+    bool operator()(int id) const
+    {
+        if (bitmap && !((bitmap[id >> 6] >> (id & 63)) & 1))
+            return false;
+        return !accept || accept(id);
+    }
+};
+
+// Learned early termination for HNSW layer 0. After `warmup` expansions the
+// search measures two difficulty features and fixes its patience:
+//   patience = max(exp(w[0] + w[1] * lid + w[2] * gain), min_patience)
+// lid is the MLE local intrinsic dimensionality of the candidates seen so far,
+// gain = kth-best distance now / kth-best distance after the first hop. The
+// search then stops once `patience` consecutive expansions leave the top 10
+// unchanged. Weights are fitted offline by tune_termination.
+struct TerminationModel
+{
+    float w[3];
+    int warmup;
+    int min_patience;
+    bool enabled;
+
+    TerminationModel() : warmup(8), min_patience(4), enabled(false) { w[0] = w[1] = w[2] = 0.0f; }
+};
+
+// Layer-0 statistics of one query, reported by Solution::search_trace()
+struct QueryTrace
+{
+    float lid;   // features at warmup (0 when the search ended before it)
+    float gain;
+    int hops;    // expansions performed
+    int max_gap; // longest run of expansions that ended in a top-10 improvement
+
+    QueryTrace() : lid(0.0f), gain(1.0f), hops(0), max_gap(0) {}
+};
+
+// Per-query search counters. They are kept thread-locally and folded into
+// the index totals once per public query. Build with -DSEARCH_STATS=0 to
+// compile the hot-loop increments out; queries are still counted.
+#ifndef SEARCH_STATS
+#define SEARCH_STATS 1
+#endif
+
+struct SearchStats
+{
+    long long queries;
+    long long hops;             // candidates expanded (all layers)
+    long long distance_calls;   // full distance evaluations
+    long long partial_prunes;   // neighbors abandoned by the bounded distance
+    long long visited;          // vertices first seen
+    long long pool_insertions;  // entries added to the candidate pool
+    long long levels_descended; // upper layers walked greedily
+    long long truncated;        // queries cut short by their hop / time budget
+
+    SearchStats() : queries(0), hops(0), distance_calls(0), partial_prunes(0), visited(0),
+                    pool_insertions(0), levels_descended(0), truncated(0) {}
+};
+
+// Where the last HNSW build spent its time. Stage times are seconds summed
+// over build threads (so they can exceed wall time); wall_time is elapsed.
+struct BuildStats
+{
+    double level_assignment;
+    double upper_descent;    // greedy ef=1 walk above the insertion level
+    double candidate_search; // ef_construction searches, layer 0 included
+    double pruning;          // select_neighbors_heuristic on new vertices
+    double linking;          // reverse edges incl. lazy re-prunes and lock waits
+    double lock_wait;        // part of linking spent spinning on node locks
+    double flatten;          // final layer-0 prune and flatten
+    double wall_time;
+    long long inserts;
+    long long distance_calls; // made by the insert searches
+    long long lazy_prunes;    // neighbor lists re-pruned after overflowing
+    long long contended_locks;
+
+    BuildStats() : level_assignment(0), upper_descent(0), candidate_search(0), pruning(0), linking(0),
+                   lock_wait(0), flatten(0), wall_time(0), inserts(0), distance_calls(0),
+                   lazy_prunes(0), contended_locks(0) {}
+};
+
+// Periodic build progress, delivered on whichever build thread notices the
+// interval has passed
+struct BuildProgress
+{
+    long long inserted;
+    long long total;
+    double elapsed;         // seconds since the insert phase started
+    double inserts_per_sec; // over the last interval
+};
+
+// Mini-batch k-means over row-major float data (squared L2). Trains on a
+// random sample of at most k * max_points_per_centroid points; centroids are
+// contiguous (k x dim). Assignment is multi-threaded and blocked: each point
+// is compared against tiles of centroids as ||c||^2 - 2 x.c, four at a time.
+// Shared by the IVF builder and anything else that needs clustering.
+class KMeans
+{
+private:
+    int k;
+    int dim;
+    int max_iterations;          // Lloyd passes; mini-batch runs 8x this many batches
+    int batch_size;              // mini-batch size (0 = always full-batch Lloyd)
+    int max_points_per_centroid; // training sample cap = k * this
+    mt19937 rng;
+
+    vector<float> centroids;      // k x dim
+    vector<float> centroid_norms; // ||c||^2
+
+    void update_norms();
+    void lloyd(const float *data, int n, vector<int> &labels);
+    void mini_batch(const float *data, int n, vector<int> &labels);
+    long long mini_batch_steps() const { return 8LL * max_iterations; }
+
+public:
+    KMeans(int k_val, int dim_val, unsigned seed = 42);
+
+    void set_parameters(int iterations, int batch, int points_per_centroid);
+    void train(const float *data, int n);
+    // labels[i] = nearest centroid of row i; dists (optional) = squared L2
+    void assign(const float *data, int n, int *labels, float *dists = nullptr) const;
+
+    const vector<float> &get_centroids() const { return centroids; }
+    int num_clusters() const { return k; }
+};
+
+// Per-call search settings. A query reads only its own SearchParams, so one
+// shared Solution can serve callers with different settings concurrently.
+// default_search_params() fills them from the index-wide settings.
+struct SearchParams
+{
+    int ef;               // layer-0 candidate list size (raised to k, capped at 512); 0 = index ef_search
+    int k;                // results written to res
+    float gamma;          // > 0 enables the adaptive layer-0 rule
+    int max_hops;         // layer-0 expansions allowed; 0 = unlimited
+    float time_budget_ms; // per-query deadline from search entry; 0 = unlimited
+
+    explicit SearchParams(int ef_ = 0, int k_ = 10, float gamma_ = 0.0f)
+        : ef(ef_), k(k_), gamma(gamma_), max_hops(0), time_budget_ms(0.0f) {}
+};
+
+struct SearchBudget; // per-query deadline / hop allowance (MySolution.cpp)
+
 class Solution
 {
 private:
@@ -25,12 +206,51 @@ private:
     int max_level;       // maximum level
     float ml;            // level multiplier
     float gamma;         // adaptive search threshold
+    bool user_params;    // set_parameters() called: skip the per-dataset defaults
+    TerminationModel term_model; // learned layer-0 stop rule (overrides gamma)
+    Metric metric;       // distance metric (see Metric)
+    IndexType index_type;   // requested backend
+    IndexType active_index; // backend chosen by build()
+    int flat_threshold;     // INDEX_AUTO uses FLAT up to this many vectors
+    int range_result_limit; // max ids returned by the vector form of range_search
+    int prefetch_distance;  // neighbors ahead whose vectors are prefetched in graph walks
+    int prefetch_lines;     // cache lines prefetched per vector, 0 = the whole vector
+    bool prefetch_user;     // set_prefetch() called: skip calibration
 
     // Data storage
     int dimension;
     int num_vectors;
     vector<float> vectors;
+    const float *vec_data;   // vectors.data(), or borrowed storage (build_view)
     vector<int> entry_point; // vector to allow easy swap, though usually size 1
+    vector<float> base_norms; // ||x||^2 per storage row, for the exact engine (L2)
+
+    // Storage dimension order: stored position j holds original dimension
+    // dim_order[j] (decreasing variance, see set_dimension_reorder). Empty
+    // means identity; queries are permuted on the way in.
+    bool reorder_dims;
+    vector<int> dim_order;
+
+    // ADSampling (see set_random_rotation): D x D row-major orthogonal matrix
+    // applied to the base and every query, empty when off. abandon_scale[k]
+    // scales the early-abandon bound after 32 * (k + 1) dimensions.
+    bool rotate_vectors;
+    float rotation_epsilon;
+    vector<float> rotation;
+    vector<float> abandon_scale;
+
+    // Storage row order of `vectors`. Empty means identity (HNSW / FLAT);
+    // IVF stores vectors list by list so each list is one contiguous block.
+    vector<int> row_to_id;
+    vector<int> id_to_row;
+
+    // IVF: list l owns storage rows [ivf_offsets[l], ivf_offsets[l + 1])
+    int ivf_nlist;               // requested list count (0 = 4 * sqrt(N))
+    int ivf_nprobe;              // lists scanned per query
+    vector<float> ivf_centroids; // nlist x d, contiguous
+    vector<int> ivf_offsets;
+    unique_ptr<Solution> centroid_index;          // routes queries to lists
+    vector<unique_ptr<Solution>> ivf_partitions;  // IVF_HNSW: graph per list (borrowed rows)
 
     // HNSW graph structure
     // graph[level][vertex_id] = list of neighbors
@@ -44,6 +264,7 @@ private:
     struct NodeLock
     {
         std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        bool try_acquire() { return !lock.test_and_set(std::memory_order_acquire); }
         void acquire()
         {
             while (lock.test_and_set(std::memory_order_acquire))
@@ -60,46 +281,304 @@ private:
     // Using a pointer array or fixed vector to avoid reallocation issues
     vector<NodeLock> node_locks;
 
+    // Soft deletes: one bit per vertex. Deleted vertices stay routable until
+    // the compaction pass rewires their in-neighbors and clears their edges.
+    // Their ids and vector rows stay allocated: there is no insert path that
+    // could reuse them.
+    vector<std::atomic<uint64_t>> tombstones;
+    std::atomic<int> num_deleted;      // total tombstoned vertices
+    vector<int> pending_deletes;       // tombstoned but not yet compacted
+    vector<int> detached_ids;          // compacted: edges cleared, no live row points at them
+    mutable std::mutex delete_mutex;   // guards pending_deletes / detached_ids
+    float compaction_threshold;        // fraction of num_vectors that triggers compaction
+    std::thread compaction_thread;
+    std::atomic<bool> compaction_running;
+
     // Helper structures
     mt19937 rng;
+    // Build telemetry
+    BuildStats build_stats;
+    std::function<void(const BuildProgress &)> build_progress;
+    double build_progress_interval;
+
+    // Query totals (distance calls live in distance_computations)
     mutable std::atomic<long long> distance_computations;
+    mutable std::atomic<long long> stat_queries, stat_hops, stat_partial_prunes, stat_visited,
+        stat_pool_insertions, stat_levels_descended, stat_truncated;
+
+    // Outermost public query on a thread: resets that thread's counters on
+    // entry and adds them to the totals on exit (a batch group counts as
+    // `queries` queries)
+    struct QueryStatsScope
+    {
+        const Solution &owner;
+        int queries;
+        explicit QueryStatsScope(const Solution &s, int queries = 1);
+        ~QueryStatsScope();
+    };
+
+    // Software prefetch of a base vector (prefetch_lines of it) and of a
+    // layer-0 adjacency row
+    inline void prefetch_vector(int id) const;
+    inline void prefetch_row(int id) const;
 
-    // Distance calculation
+    // Distance calculation (metric dispatch; hot loops use the templated *_impl)
     inline float distance(const float *a, const float *b, int dim) const;
+    // Returns query.data(), or a normalized copy in scratch for cosine
+    const float *prepare_query(const vector<float> &query, vector<float> &scratch) const;
+    // Same for a row-major batch of queries
+    const float *prepare_queries(const vector<float> &queries, vector<float> &scratch) const;
+    void reorder_dimensions();
+    void rotate_row(const float *x, float *y) const;
+    void make_rotation();
+    void update_abandon_scale();
     
-    // 第八批优化：用于早期剪枝的部分距离计算
-    inline float partial_distance(const float *a, const float *b, int dim) const;
-
     // HNSW methods
     int random_level();
 
-    // Internal search that uses thread_local storage
+    // Internal search that uses thread_local storage; reads ef and gamma
+    // from params only. stop_bound lets a caller cut layer 0 short once
+    // candidates pass an external k-th best; model/trace enable the learned
+    // stop rule and statistics at layer 0; budget (armed from the query's
+    // params at search entry) ends layer 0 early and records truncation.
     vector<int> search_layer(const float *query, const vector<int> &entry_points,
-                             int ef, int level) const;
+                             int level, const SearchParams &params,
+                             float stop_bound = numeric_limits<float>::max(),
+                             const TerminationModel *model = nullptr,
+                             QueryTrace *trace = nullptr,
+                             SearchBudget *budget = nullptr) const;
 
     vector<int> search_layer_adaptive(const float *query, const vector<int> &entry_points,
-                                      int ef, int level, float gamma) const;
+                                      int level, const SearchParams &params,
+                                      SearchBudget *budget = nullptr) const;
+
+    // ef=1 walk through levels top..bottom (inclusive) starting from ep:
+    // move to the best neighbor until none improves. Allocates nothing and
+    // keeps no visited set. Returns the closest vertex found on bottom.
+    int greedy_descent(const float *query, int ep, int top, int bottom) const;
 
-    void select_neighbors_heuristic(vector<int> &neighbors, int M_level);
-    void connect_neighbors(int vertex, int level, const vector<int> &neighbors);
+    void select_neighbors_heuristic(vector<int> &neighbors, int M_level, int base_node = -1);
 
-    void search_hnsw(const vector<float> &query, int *res);
+    // Metric-specialized bodies; the wrappers above switch on metric once per call
+    template <class Space>
+    vector<int> search_layer_impl(const float *query, const vector<int> &entry_points,
+                                  int level, const SearchParams &params, float stop_bound,
+                                  const TerminationModel *model, QueryTrace *trace,
+                                  SearchBudget *budget) const;
+    template <class Space>
+    vector<int> search_layer_adaptive_impl(const float *query, const vector<int> &entry_points,
+                                           int level, const SearchParams &params,
+                                           SearchBudget *budget) const;
+    // The one graph walk; Stop is a termination policy (see MySolution.cpp)
+    template <class Space, class Stop>
+    vector<int> search_kernel(const float *query, const vector<int> &entry_points, int level,
+                              Stop &stop, SearchBudget *budget) const;
+    template <class Space>
+    int greedy_descent_impl(const float *query, int ep, int top, int bottom) const;
+    template <class Space>
+    void select_neighbors_heuristic_impl(vector<int> &neighbors, int M_level, int base_node);
+    void connect_neighbors(int vertex, int level, const vector<int> &neighbors, BuildStats *stats = nullptr);
+
+    // params.k ids in the search() result convention
+    void search_hnsw(const vector<float> &query, const SearchParams &params, int *res,
+                     QueryTrace *trace = nullptr) const;
+
+    // Build over existing storage, shared by build() and build_view()
+    void build_index();
+    void build_view(int d, const float *data, int n);
+    // Layer-0 list size for params: ef (or ef_search when 0), at least k
+    int layer0_ef(const SearchParams &params) const { return max(params.ef > 0 ? params.ef : ef_search, params.k); }
+    void search_topk(const float *query, const SearchParams &params, vector<pair<float, int>> &out,
+                     float stop_bound = numeric_limits<float>::max()) const;
+
+    // Filtered search helpers
+    float estimate_selectivity(const SearchFilter &filter) const;
+    vector<pair<float, int>> brute_force_filtered(const float *query, int k,
+                                                  const SearchFilter &filter) const;
+    vector<pair<float, int>> search_layer_filtered(const float *query, const vector<int> &entry_points,
+                                                   int ef, int result_cap,
+                                                   const SearchFilter &filter) const;
+    template <class Space>
+    vector<pair<float, int>> search_layer_filtered_impl(const float *query, const vector<int> &entry_points,
+                                                        int ef, int result_cap,
+                                                        const SearchFilter &filter) const;
+
+    inline int row_of(int id) const { return id_to_row.empty() ? id : id_to_row[id]; }
+    inline int id_of(int row) const { return row_to_id.empty() ? row : row_to_id[row]; }
+
+    // IVF
+    void build_ivf();
+    // params.ef sizes the centroid-graph walk that picks the lists (and, for
+    // IVF_HNSW, each partition walk); nprobe stays index-wide
+    void search_ivf_hnsw(const float *query, const SearchParams &params, int *res) const;
+    template <class Space>
+    void search_ivf_impl(const float *query, const SearchParams &params, int *res) const;
+    template <class Space>
+    void ivf_scan_list(const float *query, int list, int k, vector<pair<float, int>> &heap) const;
+
+    // Exact engine: out_ids / out_dists are nq x k, in the search() convention
+    void exact_knn(const float *queries, int nq, int k, int *out_ids, float *out_dists) const;
+
+    // Recall-targeted tuning of the search-time knobs (ef_search / gamma for
+    // HNSW, nprobe for IVF) on pseudo-queries sampled from the base
+    void autotune(float target_recall);
+    bool search_ids(const float *query, const SearchParams &params, int *res) const; // prepared query, any backend
+    // Interleaved HNSW walk of up to 16 prepared queries (see search_batch)
+    template <class Space>
+    void search_group_impl(const float *queries, int count, const SearchParams &params, int *res) const;
+    double sample_recall(const vector<float> &sample, const vector<int> &self_ids,
+                         const vector<int> &truth, int k) const;
+
+    // Deletion helpers
+    inline bool is_deleted(int id) const
+    {
+        return (tombstones[id >> 6].load(std::memory_order_relaxed) >> (id & 63)) & 1;
+    }
+    void repair_level(int level);
+    void run_compaction();
+    void wait_for_compaction();
 
 public:
     Solution();
     ~Solution();
 
     void set_parameters(int M_val, int ef_c, int ef_s);
+    void set_metric(Metric m) { metric = m; } // call before build()
+    void set_index_type(IndexType t) { index_type = t; } // call before build()
+    // L2 only, call before build(): store dimensions in decreasing-variance
+    // order so the early-abandoned distance passes its bound sooner. Queries
+    // are permuted on the way in; results match up to float rounding.
+    void set_dimension_reorder(bool on) { reorder_dims = on; }
+    // L2 only: before build(), rotate the base and every query by a random
+    // orthogonal matrix (distances are unchanged, so it replaces the
+    // dimension reorder) and let the early-abandoned distance drop a
+    // neighbor on ADSampling's hypothesis test: after d of D dimensions, when
+    // partial * D / d > bound * (1 + epsilon0 / sqrt(d))^2. A larger epsilon0
+    // prunes less and falsely prunes less; 0 keeps only the exact test.
+    // After build() it just retunes epsilon0 (saved with the graph).
+    void set_random_rotation(bool on, float epsilon0 = 2.1f);
+    void set_ivf_parameters(int nlist, int nprobe) { ivf_nlist = nlist; ivf_nprobe = nprobe; }
+    void set_nprobe(int nprobe) { ivf_nprobe = nprobe; }
+
+    // Result convention of every k-NN entry point (search, search_batch,
+    // search_exact, search_filtered): ids nearest first, and slots without a
+    // hit (too few live or allowed ids, or a truncated walk) hold -1.
+
+    // Exact k-NN for a batch of row-major queries (nq x d). ids is resized to
+    // nq x k; dists likewise (FLT_MAX where ids is -1) when non-null.
+    void search_exact(const vector<float> &queries, int k, vector<int> &ids, vector<float> *dists = nullptr);
+    // Writes exact top-k ids for each query, one line per query, in the
+    // groundtruth.txt format test_solution.cpp reads
+    bool write_groundtruth(const string &filename, const vector<float> &queries, int k);
     void build(int d, const vector<float> &base);
+    // build(), then pick the cheapest search settings whose recall@10 on a
+    // held-out sample of base rows reaches target_recall (logged to stderr)
+    void build(int d, const vector<float> &base, float target_recall);
     void search(const vector<float> &query, int *res);
+    // Top-k ids with the current settings, any k
+    void search(const vector<float> &query, int k, int *res);
+    // Top-params.k ids with per-call settings; safe to call from many
+    // threads with different params. IVF backends use ef for routing only
+    // (nprobe stays index-wide). Anytime: when max_hops or
+    // time_budget_ms runs out, layer 0 stops and the best k found so far are
+    // returned; the result is true exactly when that happened (truncated).
+    bool search(const vector<float> &query, const SearchParams &params, int *res) const;
+    SearchParams default_search_params(int k = 10) const { return SearchParams(ef_search, k, gamma); }
+    // Many queries at once (row-major, nq x dimension); res is nq x params.k.
+    // Each thread walks `group` queries (1..16) in lockstep at HNSW layer 0:
+    // it prefetches one query's next neighbor vectors, then works on the
+    // others while those lines arrive. Results match per-query search().
+    // The gamma rule, budgets, the learned stop rule and non-HNSW backends
+    // fall back to one search() per query.
+    void search_batch(const vector<float> &queries, const SearchParams &params, int *res, int group = 8) const;
 
+    // Binary snapshot of an HNSW or FLAT index (vectors, levels, adjacency,
+    // search settings, tombstones). load_graph() replaces this index and
+    // needs no build(); IVF backends are not persisted (save returns false).
     bool save_graph(const string &filename) const;
     bool load_graph(const string &filename);
 
+    // Top-k restricted to ids accepted by filter; returns the number of hits
+    // (may be < k if fewer ids pass). Very selective filters are answered by
+    // an exact scan of the allowed ids instead of the graph. The params form
+    // sizes the walk from params.ef (widened by 1 / selectivity).
+    int search_filtered(const vector<float> &query, int k, const SearchFilter &filter, int *res);
+    int search_filtered(const vector<float> &query, const SearchParams &params, const SearchFilter &filter,
+                        int *res) const;
+
+    // Range search: every id within radius of query (Euclidean radius for
+    // METRIC_L2, raw metric distance otherwise). The callback form streams
+    // (id, distance) pairs as they are found (unsorted); return false from
+    // emit to stop early. The vector form appends at most range_result_limit
+    // hits. Both return the hit count.
+    int range_search(const vector<float> &query, float radius,
+                     const std::function<bool(int, float)> &emit);
+    int range_search(const vector<float> &query, float radius,
+                     vector<int> &out_ids, vector<float> &out_dists);
+    // Same with per-call settings: params.ef sizes the seeding walk
+    int range_search(const vector<float> &query, float radius, const SearchParams &params,
+                     const std::function<bool(int, float)> &emit) const;
+    int range_search(const vector<float> &query, float radius, const SearchParams &params,
+                     vector<int> &out_ids, vector<float> &out_dists) const;
+    void set_range_result_limit(int limit) { range_result_limit = limit; }
+
+    // Soft delete: the id is never returned again; the graph is repaired in
+    // the background once the tombstone count crosses the threshold.
+    bool remove(int id);
+    void compact(); // synchronous repair; detaches the pending deletes
+    void set_compaction_threshold(float ratio) { compaction_threshold = ratio; }
+    int get_num_deleted() const { return num_deleted.load(); }
+
+    // Learned early termination (see TerminationModel). When enabled it
+    // replaces both the fixed slack and the gamma rule at HNSW layer 0, in
+    // every search() form (per-call params and search_batch included).
+    // The file holds "w0 w1 w2 warmup min_patience" as written by tune_termination.
+    void set_termination_model(const TerminationModel &model) { term_model = model; }
+    bool load_termination_model(const string &filename);
+    const TerminationModel &get_termination_model() const { return term_model; }
+    // search() that also records layer-0 statistics; always runs the
+    // fixed-ef path (plus the model when enabled) so traces are comparable
+    void search_trace(const vector<float> &query, int *res, QueryTrace &trace);
+
     // Additional public interface for test harness
     void set_ef_search(int ef) { ef_search = ef; }
-    void reset_distance_computations() { distance_computations.store(0); }
+    int get_ef_search() const { return ef_search; }
+    void set_gamma(float g) { gamma = g; } // > 0 enables the adaptive layer-0 rule
+    float get_gamma() const { return gamma; }
+    int get_nprobe() const { return ivf_nprobe; }
+
+    // Prefetch tuning. Graph walks prefetch every cache line of the vector
+    // `distance` neighbors ahead, plus the next candidate's adjacency row.
+    // build() and load_graph() pick the distance with a short timing run on
+    // base rows (calibrate_prefetch) unless set_prefetch() was called.
+    void set_prefetch(int distance, int lines = 0)
+    {
+        prefetch_distance = max(0, distance);
+        prefetch_lines = max(0, lines);
+        prefetch_user = true;
+    }
+    int get_prefetch_distance() const { return prefetch_distance; }
+    void calibrate_prefetch();
+    void reset_distance_computations() { reset_search_stats(); }
     long long get_distance_computations() const { return distance_computations.load(); }
+
+    // Build profiling: per-stage times and counters of the last HNSW build,
+    // and an optional progress callback invoked every interval seconds
+    // during the insert phase (from a build thread).
+    const BuildStats &get_build_stats() const { return build_stats; }
+    void set_build_progress_callback(std::function<void(const BuildProgress &)> cb, double interval_sec = 1.0)
+    {
+        build_progress = cb;
+        build_progress_interval = interval_sec;
+    }
+
+    // Counters summed over all queries since the last reset. Work done on
+    // OpenMP helper threads inside one query (parallel IVF probes) is not
+    // included.
+    SearchStats get_search_stats() const;
+    void reset_search_stats();
+    // Counters of the calling thread's most recent query
+    static SearchStats last_query_stats();
 };
 
 #endif // MY_SOLUTION_H
@@ -0,0 +1,179 @@
+/*
+ * Shared helpers for the benchmark tools: dataset loading, ground truth,
+ * recall and an HDR-style latency histogram.
+ */
+
+#ifndef BENCHMARK_COMMON_H
+#define BENCHMARK_COMMON_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+// Load vectors from file (line-by-line format), skipping an optional
+// "count dim" metadata line
+inline vector<float> load_vectors(const string &filename, int &dimension, int &num_vectors)
+{
+    ifstream file(filename);
+    if (!file.is_open())
+    {
+        cerr << "Failed to open file: " << filename << endl;
+        return vector<float>();
+    }
+
+    string line;
+    vector<float> vectors;
+    num_vectors = 0;
+    bool first_line = true;
+
+    while (getline(file, line))
+    {
+        istringstream iss(line);
+        vector<float> vec;
+        float val;
+        while (iss >> val)
+            vec.push_back(val);
+        if (vec.empty())
+            continue;
+
+        if (first_line && vec.size() == 2 && dimension != 2)
+        {
+            first_line = false;
+            continue;
+        }
+        first_line = false;
+
+        if (dimension == 0)
+            dimension = vec.size();
+        if ((int)vec.size() != dimension)
+            continue;
+
+        vectors.insert(vectors.end(), vec.begin(), vec.end());
+        num_vectors++;
+    }
+    return vectors;
+}
+
+// One line of neighbor ids per query (groundtruth.txt format)
+inline vector<vector<int>> load_groundtruth(const string &filename)
+{
+    ifstream file(filename);
+    vector<vector<int>> groundtruth;
+    string line;
+    while (getline(file, line))
+    {
+        istringstream iss(line);
+        vector<int> ids;
+        int id;
+        while (iss >> id)
+            ids.push_back(id);
+        if (!ids.empty())
+            groundtruth.push_back(ids);
+    }
+    return groundtruth;
+}
+
+// Mean recall@k of results (k ids per query, row-major) against the first k
+// ground-truth ids; -1 when the ground truth has fewer than k columns
+inline double recall_at(const vector<int> &results, int result_k, const vector<vector<int>> &groundtruth, int k)
+{
+    if (groundtruth.empty() || k > result_k)
+        return -1.0;
+    int nq = results.size() / result_k;
+    long long hits = 0;
+    for (int i = 0; i < nq && i < (int)groundtruth.size(); ++i)
+    {
+        if ((int)groundtruth[i].size() < k)
+            return -1.0;
+        set<int> truth(groundtruth[i].begin(), groundtruth[i].begin() + k);
+        for (int j = 0; j < k; ++j)
+            hits += truth.count(results[(long long)i * result_k + j]);
+    }
+    return nq > 0 ? (double)hits / ((double)nq * k) : 0.0;
+}
+
+// Log-linear latency histogram in nanoseconds: 2^SUB_BITS linear
+// sub-buckets per power of two, so any recorded value is reported within
+// ~1.6% (HDR histogram layout, fixed 64-bit range). Cheap to record into
+// from one thread; merge per-thread copies afterwards.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BITS = 6;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+
+    LatencyHistogram() : counts((64 - SUB_BITS + 1) * SUB_COUNT, 0), total(0), sum_ns(0.0), max_ns(0) {}
+
+    void record(uint64_t ns)
+    {
+        counts[index_of(ns)]++;
+        total++;
+        sum_ns += ns;
+        max_ns = max(max_ns, ns);
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < counts.size(); ++i)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum_ns += other.sum_ns;
+        max_ns = max(max_ns, other.max_ns);
+    }
+
+    uint64_t count() const { return total; }
+    double mean_ms() const { return total ? sum_ns / total / 1e6 : 0.0; }
+    double max_ms() const { return max_ns / 1e6; }
+
+    // Value at quantile q in [0, 1], in milliseconds (bucket upper edge)
+    double percentile_ms(double q) const
+    {
+        if (total == 0)
+            return 0.0;
+        uint64_t rank = (uint64_t)ceil(q * total);
+        if (rank == 0)
+            rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return min((double)upper_edge(i), (double)max_ns) / 1e6;
+        }
+        return max_ns / 1e6;
+    }
+
+private:
+    vector<uint64_t> counts;
+    uint64_t total;
+    double sum_ns;
+    uint64_t max_ns;
+
+    static size_t index_of(uint64_t v)
+    {
+        if (v < (uint64_t)SUB_COUNT)
+            return v;
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SUB_BITS;
+        return (size_t)(shift + 1) * SUB_COUNT + ((v >> shift) & (SUB_COUNT - 1));
+    }
+
+    static uint64_t upper_edge(size_t index)
+    {
+        if (index < (size_t)SUB_COUNT)
+            return index;
+        int shift = index / SUB_COUNT - 1;
+        uint64_t sub = index % SUB_COUNT;
+        return ((SUB_COUNT + sub + 1) << shift) - 1;
+    }
+};
+
+#endif // BENCHMARK_COMMON_H
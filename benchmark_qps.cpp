@@ -0,0 +1,275 @@
+/*
+ * Closed-loop throughput benchmark
+ * Runs the query set with 1..N concurrent search threads and reports QPS,
+ * latency percentiles (p50/p95/p99/p99.9), recall@1/10/100 and distance
+ * computations per query. Results are printed as a table and written as
+ * JSON using the ann-benchmarks metric names (k-nn, qps, p50, ..., distcomps).
+ *
+ * Usage: benchmark_qps <dataset_dir> [--threads 1,2,4,8] [--ef-search N]
+ *                      [--index hnsw|flat|ivf|ivf_hnsw] [--k 100]
+ *                      [--warmup 1] [--min-time 2] [--cache graph.bin]
+ *                      [--out benchmark_results.json]
+ */
+
+#include "MySolution.h"
+#include "benchmark_common.h"
+#include <chrono>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+
+using namespace std;
+
+struct RunResult
+{
+    int threads;
+    double qps;
+    double mean_ms, p50_ms, p95_ms, p99_ms, p999_ms, max_ms;
+    double recall_1, recall_10, recall_100, recall_k;
+    double distcomps;
+    long long queries;
+};
+
+static vector<int> parse_list(const string &s)
+{
+    vector<int> out;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ','))
+        if (!item.empty())
+            out.push_back(atoi(item.c_str()));
+    return out;
+}
+
+static string json_number(double v)
+{
+    if (v < 0)
+        return "null";
+    ostringstream os;
+    os << setprecision(10) << v;
+    return os.str();
+}
+
+// Closed loop: each worker pulls the next query index from a shared counter
+// and issues it as soon as the previous one returns. Keeps going over the
+// query set until at least min_seconds have passed (and one full pass).
+static RunResult run_level(Solution &solution, const SearchParams &params, const vector<float> &queries,
+                           int dimension, int nq, int threads, double min_seconds,
+                           const vector<vector<int>> &groundtruth)
+{
+    int k = params.k;
+    vector<int> results((long long)nq * k, -1);
+    vector<LatencyHistogram> hist(threads);
+    atomic<long long> next(0);
+    atomic<bool> stop(false);
+
+    solution.reset_distance_computations();
+    auto start = chrono::steady_clock::now();
+
+    auto worker = [&](int t)
+    {
+        vector<float> q(dimension);
+        vector<int> res(k);
+        while (true)
+        {
+            long long i = next.fetch_add(1);
+            if (i >= nq && stop.load(memory_order_relaxed))
+                break;
+            int qi = i % nq;
+            copy(queries.begin() + (long long)qi * dimension, queries.begin() + (long long)(qi + 1) * dimension, q.begin());
+
+            auto t0 = chrono::steady_clock::now();
+            solution.search(q, params, res.data());
+            auto t1 = chrono::steady_clock::now();
+            hist[t].record(chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count());
+
+            if (i < nq)
+                copy(res.begin(), res.end(), results.begin() + (long long)qi * k);
+        }
+    };
+
+    vector<thread> pool;
+    for (int t = 0; t < threads; ++t)
+        pool.push_back(thread(worker, t));
+    while (chrono::duration<double>(chrono::steady_clock::now() - start).count() < min_seconds)
+        this_thread::sleep_for(chrono::milliseconds(5));
+    stop.store(true);
+    for (auto &th : pool)
+        th.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    LatencyHistogram all;
+    for (const auto &h : hist)
+        all.merge(h);
+
+    RunResult r;
+    r.threads = threads;
+    r.queries = all.count();
+    r.qps = all.count() / elapsed;
+    r.mean_ms = all.mean_ms();
+    r.p50_ms = all.percentile_ms(0.50);
+    r.p95_ms = all.percentile_ms(0.95);
+    r.p99_ms = all.percentile_ms(0.99);
+    r.p999_ms = all.percentile_ms(0.999);
+    r.max_ms = all.max_ms();
+    r.recall_1 = recall_at(results, k, groundtruth, 1);
+    r.recall_10 = recall_at(results, k, groundtruth, 10);
+    r.recall_100 = recall_at(results, k, groundtruth, 100);
+    r.recall_k = recall_at(results, k, groundtruth, k);
+    r.distcomps = (double)solution.get_distance_computations() / max(1LL, r.queries);
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " <dataset_dir> [--threads 1,2,4,8] [--ef-search N] "
+             << "[--index hnsw|flat|ivf|ivf_hnsw] [--k 100] [--warmup 1] [--min-time 2] "
+             << "[--cache graph.bin] [--out benchmark_results.json]" << endl;
+        return 1;
+    }
+
+    string dataset_dir = argv[1];
+    string out_file = "benchmark_results.json";
+    string cache_file, index_name = "auto";
+    vector<int> thread_levels;
+    int ef_search = -1, k = 100, warmup = 1;
+    double min_seconds = 2.0;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            thread_levels = parse_list(argv[++i]);
+        else if (arg == "--ef-search" && i + 1 < argc)
+            ef_search = atoi(argv[++i]);
+        else if (arg == "--index" && i + 1 < argc)
+            index_name = argv[++i];
+        else if (arg == "--k" && i + 1 < argc)
+            k = max(1, atoi(argv[++i]));
+        else if (arg == "--warmup" && i + 1 < argc)
+            warmup = atoi(argv[++i]);
+        else if (arg == "--min-time" && i + 1 < argc)
+            min_seconds = atof(argv[++i]);
+        else if (arg == "--cache" && i + 1 < argc)
+            cache_file = argv[++i];
+        else if (arg == "--out" && i + 1 < argc)
+            out_file = argv[++i];
+    }
+    if (thread_levels.empty())
+    {
+        int hw = max(1u, thread::hardware_concurrency());
+        for (int t = 1; t < hw; t *= 2)
+            thread_levels.push_back(t);
+        thread_levels.push_back(hw);
+    }
+
+    int dimension = 0, num_vectors = 0, num_queries = 0;
+    vector<float> queries = load_vectors(dataset_dir + "/query.txt", dimension, num_queries);
+    vector<vector<int>> groundtruth = load_groundtruth(dataset_dir + "/groundtruth.txt");
+    if (queries.empty())
+    {
+        cerr << "Failed to load queries" << endl;
+        return 1;
+    }
+
+    Solution solution;
+    long long build_ms = 0;
+    if (cache_file.empty() || !solution.load_graph(cache_file))
+    {
+        vector<float> base = load_vectors(dataset_dir + "/base.txt", dimension, num_vectors);
+        if (base.empty())
+        {
+            cerr << "Failed to load base vectors" << endl;
+            return 1;
+        }
+        if (index_name == "hnsw")
+            solution.set_index_type(INDEX_HNSW);
+        else if (index_name == "flat")
+            solution.set_index_type(INDEX_FLAT);
+        else if (index_name == "ivf")
+            solution.set_index_type(INDEX_IVF);
+        else if (index_name == "ivf_hnsw")
+            solution.set_index_type(INDEX_IVF_HNSW);
+
+        auto t0 = chrono::steady_clock::now();
+        solution.build(dimension, base);
+        build_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+        if (!cache_file.empty())
+            solution.save_graph(cache_file);
+    }
+    SearchParams params = solution.default_search_params(k);
+    if (ef_search > 0)
+        params.ef = ef_search;
+
+    cout << "Dataset: " << dataset_dir << " (" << num_queries << " queries, " << dimension << "D)" << endl;
+    cout << "Index: " << index_name << ", ef_search " << params.ef << ", k " << k
+         << ", build " << build_ms << " ms" << endl;
+
+    // Warm caches and page in the index before anything is timed
+    {
+        vector<int> res(k);
+        for (int w = 0; w < warmup; ++w)
+            for (int i = 0; i < num_queries; ++i)
+            {
+                vector<float> q(queries.begin() + (long long)i * dimension, queries.begin() + (long long)(i + 1) * dimension);
+                solution.search(q, params, res.data());
+            }
+    }
+
+    cout << fixed;
+    cout << setw(7) << "threads" << " | " << setw(9) << "QPS" << " | "
+         << setw(8) << "mean ms" << " | " << setw(8) << "p50" << " | " << setw(8) << "p95" << " | "
+         << setw(8) << "p99" << " | " << setw(8) << "p99.9" << " | "
+         << setw(6) << "R@1" << " | " << setw(6) << "R@10" << " | " << setw(6) << "R@100" << " | "
+         << setw(9) << "dist/q" << endl;
+
+    vector<RunResult> runs;
+    for (int threads : thread_levels)
+    {
+        RunResult r = run_level(solution, params, queries, dimension, num_queries, max(1, threads),
+                                min_seconds, groundtruth);
+        runs.push_back(r);
+        cout << setw(7) << r.threads << " | " << setw(9) << setprecision(1) << r.qps << " | "
+             << setw(8) << setprecision(3) << r.mean_ms << " | " << setw(8) << r.p50_ms << " | "
+             << setw(8) << r.p95_ms << " | " << setw(8) << r.p99_ms << " | " << setw(8) << r.p999_ms << " | "
+             << setw(6) << setprecision(4) << r.recall_1 << " | " << setw(6) << r.recall_10 << " | "
+             << setw(6) << r.recall_100 << " | " << setw(9) << setprecision(1) << r.distcomps << endl;
+    }
+
+    ofstream out(out_file);
+    if (!out)
+    {
+        cerr << "Failed to write " << out_file << endl;
+        return 1;
+    }
+    out << "{\n  \"dataset\": \"" << dataset_dir << "\",\n"
+        << "  \"algorithm\": \"" << index_name << "\",\n"
+        << "  \"count\": " << k << ",\n"
+        << "  \"build\": " << build_ms / 1000.0 << ",\n"
+        << "  \"runs\": [\n";
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        const RunResult &r = runs[i];
+        out << "    {\"parameters\": \"ef_search=" << params.ef << "\""
+            << ", \"threads\": " << r.threads
+            << ", \"queries\": " << r.queries
+            << ", \"qps\": " << json_number(r.qps)
+            << ", \"mean\": " << json_number(r.mean_ms)
+            << ", \"p50\": " << json_number(r.p50_ms)
+            << ", \"p95\": " << json_number(r.p95_ms)
+            << ", \"p99\": " << json_number(r.p99_ms)
+            << ", \"p999\": " << json_number(r.p999_ms)
+            << ", \"max\": " << json_number(r.max_ms)
+            << ", \"k-nn\": " << json_number(r.recall_k)
+            << ", \"recall@1\": " << json_number(r.recall_1)
+            << ", \"recall@10\": " << json_number(r.recall_10)
+            << ", \"recall@100\": " << json_number(r.recall_100)
+            << ", \"distcomps\": " << json_number(r.distcomps) << "}"
+            << (i + 1 < runs.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    cout << "Results written to " << out_file << " (latencies in ms)" << endl;
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Ground-truth generator
+ * Computes exact top-k neighbors with the Solution FLAT backend and writes
+ * them in the groundtruth.txt format read by test_solution.cpp
+ *
+ * Usage: gen_groundtruth <dataset_dir> [--k 100] [--metric l2|ip|cosine] [--out file]
+ */
+
+#include "MySolution.h"
+#include "benchmark_common.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " <dataset_dir> [--k 100] [--metric l2|ip|cosine] [--out file]" << endl;
+        return 1;
+    }
+
+    string dataset_dir = argv[1];
+    string out_file = dataset_dir + "/groundtruth.txt";
+    int k = 100;
+    Metric metric = METRIC_L2;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--k" && i + 1 < argc)
+        {
+            k = atoi(argv[++i]);
+        }
+        else if (arg == "--out" && i + 1 < argc)
+        {
+            out_file = argv[++i];
+        }
+        else if (arg == "--metric" && i + 1 < argc)
+        {
+            string m = argv[++i];
+            if (m == "ip")
+                metric = METRIC_IP;
+            else if (m == "cosine")
+                metric = METRIC_COSINE;
+        }
+    }
+
+    int dimension = 0, num_vectors = 0, num_queries = 0;
+    cout << "Loading base vectors..." << endl;
+    vector<float> base = load_vectors(dataset_dir + "/base.txt", dimension, num_vectors);
+    if (base.empty())
+    {
+        cerr << "Failed to load base vectors" << endl;
+        return 1;
+    }
+    cout << "  " << num_vectors << " x " << dimension << "D" << endl;
+
+    vector<float> queries = load_vectors(dataset_dir + "/query.txt", dimension, num_queries);
+    if (queries.empty())
+    {
+        cerr << "Failed to load queries" << endl;
+        return 1;
+    }
+    cout << "  " << num_queries << " queries" << endl;
+
+    Solution solution;
+    solution.set_metric(metric);
+    solution.set_index_type(INDEX_FLAT);
+    solution.build(dimension, base);
+
+    auto start = chrono::high_resolution_clock::now();
+    if (!solution.write_groundtruth(out_file, queries, k))
+    {
+        cerr << "Failed to write " << out_file << endl;
+        return 1;
+    }
+    auto end = chrono::high_resolution_clock::now();
+
+    cout << "Wrote top-" << k << " ground truth to " << out_file << " in "
+         << chrono::duration_cast<chrono::milliseconds>(end - start).count() << " ms" << endl;
+    return 0;
+}
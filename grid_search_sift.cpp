@@ -1,6 +1,10 @@
 /*
  * Grid Search Parameter Tuning for SIFT Dataset
- * Systematically tests parameter combinations and outputs detailed results
+ * Builds each (M, ef_construction) graph once, in parallel, and caches it with
+ * save_graph(); then sweeps ef_search x gamma against every cached graph.
+ * Outputs all results plus the QPS / recall@10 Pareto frontier (CSV + JSON).
+ *
+ * Usage: grid_search_sift [dataset_dir] [--cache-dir dir] [--threads N] [--build-jobs 2]
  */
 
 #include "MySolution.h"
@@ -12,6 +16,12 @@
 #include <string>
 #include <set>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
@@ -197,21 +207,62 @@ struct ParamResult
     int M;
     int ef_construction;
     int ef_search;
+    float gamma;
     long long build_time_ms;
     long long search_time_ms;
     double avg_search_ms;
+    double qps;
     double recall_1;
     double recall_10;
     double score; // Composite score
+    bool pareto;  // on the QPS / recall@10 frontier
 };
 
+struct GraphBuild
+{
+    int M;
+    int ef_construction;
+    string cache_file;
+    long long build_time_ms;
+    bool ok;
+};
+
+// Marks the configurations no other one beats on both recall@10 and QPS
+void mark_pareto(vector<ParamResult> &results)
+{
+    vector<int> order(results.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    sort(order.begin(), order.end(), [&](int a, int b)
+         { return results[a].recall_10 != results[b].recall_10 ? results[a].recall_10 > results[b].recall_10
+                                                               : results[a].qps > results[b].qps; });
+    double best_qps = -1.0;
+    for (int i : order)
+    {
+        results[i].pareto = results[i].qps > best_qps;
+        if (results[i].pareto)
+            best_qps = results[i].qps;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     // Parse command line arguments
     string dataset_dir = "../data_o/data_o/sift_small";
-    if (argc > 1)
+    string cache_dir = ".";
+    int threads = max(1u, thread::hardware_concurrency());
+    int build_jobs = 2; // concurrent graph builds; each holds its own copy of the base set
+    for (int i = 1; i < argc; ++i)
     {
-        dataset_dir = argv[1];
+        string arg = argv[i];
+        if (arg == "--cache-dir" && i + 1 < argc)
+            cache_dir = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = max(1, atoi(argv[++i]));
+        else if (arg == "--build-jobs" && i + 1 < argc)
+            build_jobs = max(1, atoi(argv[++i]));
+        else
+            dataset_dir = arg;
     }
 
     string base_file = dataset_dir + "/base.txt";
@@ -246,8 +297,10 @@ int main(int argc, char *argv[])
     vector<int> M_values = {12, 16, 20, 24};
     vector<int> ef_construction_values = {100, 150, 200, 300};
     vector<int> ef_search_values = {50, 100, 200, 300, 400, 500};
+    vector<float> gamma_values = {0.0f, 0.1f, 0.25f}; // 0 = fixed-ef search
 
-    int total_combinations = M_values.size() * ef_construction_values.size() * ef_search_values.size();
+    int total_graphs = M_values.size() * ef_construction_values.size();
+    int total_combinations = total_graphs * ef_search_values.size() * gamma_values.size();
 
     cout << "Parameter Grid:" << endl;
     cout << "  M: ";
@@ -262,19 +315,80 @@ int main(int argc, char *argv[])
     for (int ef : ef_search_values)
         cout << ef << " ";
     cout << endl;
-    cout << "  Total combinations: " << total_combinations << endl
+    cout << "  gamma: ";
+    for (float g : gamma_values)
+        cout << g << " ";
+    cout << endl;
+    cout << "  Graphs: " << total_graphs << ", total combinations: " << total_combinations << endl
          << endl;
 
-    // Results storage
+    // Phase 1: build every distinct graph once, build_jobs at a time. Each
+    // worker gets an even share of the cores for the build's own OpenMP loop.
+    // Every Solution copies the base set and adds its graph, so memory grows
+    // with the worker count; keep it low on full SIFT / GloVe.
+    vector<GraphBuild> builds;
+    for (int M : M_values)
+        for (int ef_c : ef_construction_values)
+        {
+            GraphBuild b;
+            b.M = M;
+            b.ef_construction = ef_c;
+            b.cache_file = cache_dir + "/grid_M" + to_string(M) + "_efc" + to_string(ef_c) + ".bin";
+            b.build_time_ms = 0;
+            b.ok = false;
+            builds.push_back(b);
+        }
+
+    int workers = min(min(threads, build_jobs), total_graphs);
+    int max_M = *max_element(M_values.begin(), M_values.end());
+    long long build_mb = (long long)num_vectors * (dimension + 2 * max_M) * sizeof(float) >> 20;
+    cout << "Building " << total_graphs << " graphs on " << workers << " workers (~" << build_mb
+         << " MB of vectors + layer 0 each)..." << endl;
+    atomic<int> next_build(0);
+    vector<thread> pool;
+    for (int w = 0; w < workers; ++w)
+    {
+        pool.push_back(thread([&]()
+                              {
+#ifdef _OPENMP
+            omp_set_num_threads(max(1, threads / workers));
+#endif
+            for (int i = next_build++; i < total_graphs; i = next_build++)
+            {
+                GraphBuild &b = builds[i];
+                Solution solution;
+                solution.set_parameters(b.M, b.ef_construction, ef_search_values[0]);
+                auto build_start = chrono::high_resolution_clock::now();
+                solution.build(dimension, base_vectors);
+                auto build_end = chrono::high_resolution_clock::now();
+                b.build_time_ms = chrono::duration_cast<chrono::milliseconds>(build_end - build_start).count();
+                b.ok = solution.save_graph(b.cache_file);
+            } }));
+    }
+    for (auto &t : pool)
+        t.join();
+
+    for (const auto &b : builds)
+    {
+        cout << "  M=" << setw(2) << b.M << " ef_c=" << setw(3) << b.ef_construction << "  "
+             << fixed << setprecision(2) << (b.build_time_ms / 1000.0) << "s"
+             << (b.ok ? "" : "  (cache write failed)") << endl;
+    }
+    cout << endl;
+
+    // Phase 2: sweep search settings on each cached graph (serially, so
+    // latencies are not skewed by other sweeps)
     vector<ParamResult> results;
 
-    cout << "Starting grid search..." << endl;
+    cout << "Starting search sweep..." << endl;
     cout << "------------------------------------------------------------" << endl;
     cout << setw(3) << "M" << " | "
          << setw(5) << "ef_c" << " | "
          << setw(5) << "ef_s" << " | "
+         << setw(5) << "gamma" << " | "
          << setw(8) << "Build(s)" << " | "
          << setw(8) << "Query(ms)" << " | "
+         << setw(8) << "QPS" << " | "
          << setw(7) << "R@1" << " | "
          << setw(7) << "R@10" << " | "
          << setw(7) << "Score" << endl;
@@ -282,22 +396,23 @@ int main(int argc, char *argv[])
 
     int test_count = 0;
 
-    for (int M : M_values)
+    for (const auto &b : builds)
     {
-        for (int ef_c : ef_construction_values)
+        Solution solution;
+        if (!b.ok || !solution.load_graph(b.cache_file))
+        {
+            cerr << "Skipping M=" << b.M << " ef_c=" << b.ef_construction << ": cannot load " << b.cache_file << endl;
+            test_count += ef_search_values.size() * gamma_values.size();
+            continue;
+        }
+
+        for (float g : gamma_values)
         {
             for (int ef_s : ef_search_values)
             {
                 test_count++;
-
-                // Build index
-                Solution solution;
-                solution.set_parameters(M, ef_c, ef_s);
-
-                auto build_start = chrono::high_resolution_clock::now();
-                solution.build(dimension, base_vectors);
-                auto build_end = chrono::high_resolution_clock::now();
-                auto build_time = chrono::duration_cast<chrono::milliseconds>(build_end - build_start).count();
+                solution.set_ef_search(ef_s);
+                solution.set_gamma(g);
 
                 // Perform searches
                 auto search_start = chrono::high_resolution_clock::now();
@@ -311,8 +426,8 @@ int main(int argc, char *argv[])
                 }
 
                 auto search_end = chrono::high_resolution_clock::now();
-                auto search_time = chrono::duration_cast<chrono::milliseconds>(search_end - search_start).count();
-                double avg_search = (double)search_time / queries.size();
+                double search_ms = chrono::duration<double, milli>(search_end - search_start).count();
+                double avg_search = search_ms / queries.size();
 
                 // Calculate recall
                 double recall_1 = calculate_recall(all_results, groundtruth, 1);
@@ -320,27 +435,32 @@ int main(int argc, char *argv[])
 
                 // Calculate composite score (higher is better)
                 // Score = recall@10 * 100 - build_time_penalty - search_time_penalty
-                double score = recall_10 * 100.0 - (build_time / 1000.0) * 0.01 - avg_search * 0.1;
+                double score = recall_10 * 100.0 - (b.build_time_ms / 1000.0) * 0.01 - avg_search * 0.1;
 
                 // Store result
                 ParamResult result;
-                result.M = M;
-                result.ef_construction = ef_c;
+                result.M = b.M;
+                result.ef_construction = b.ef_construction;
                 result.ef_search = ef_s;
-                result.build_time_ms = build_time;
-                result.search_time_ms = search_time;
+                result.gamma = g;
+                result.build_time_ms = b.build_time_ms;
+                result.search_time_ms = (long long)search_ms;
                 result.avg_search_ms = avg_search;
+                result.qps = search_ms > 0 ? queries.size() * 1000.0 / search_ms : 0.0;
                 result.recall_1 = recall_1;
                 result.recall_10 = recall_10;
                 result.score = score;
+                result.pareto = false;
                 results.push_back(result);
 
                 // Print progress
-                cout << setw(3) << M << " | "
-                     << setw(5) << ef_c << " | "
+                cout << setw(3) << b.M << " | "
+                     << setw(5) << b.ef_construction << " | "
                      << setw(5) << ef_s << " | "
-                     << setw(8) << fixed << setprecision(2) << (build_time / 1000.0) << " | "
-                     << setw(8) << fixed << setprecision(2) << avg_search << " | "
+                     << setw(5) << fixed << setprecision(2) << g << " | "
+                     << setw(8) << fixed << setprecision(2) << (b.build_time_ms / 1000.0) << " | "
+                     << setw(8) << fixed << setprecision(3) << avg_search << " | "
+                     << setw(8) << fixed << setprecision(0) << result.qps << " | "
                      << setw(7) << fixed << setprecision(4) << recall_1 << " | "
                      << setw(7) << fixed << setprecision(4) << recall_10 << " | "
                      << setw(7) << fixed << setprecision(2) << score
@@ -352,6 +472,13 @@ int main(int argc, char *argv[])
     cout << "============================================================" << endl
          << endl;
 
+    if (results.empty())
+    {
+        cerr << "No results" << endl;
+        return 1;
+    }
+    mark_pareto(results);
+
     // Find best configurations
     auto best_recall = results[0];
     auto best_speed = results[0];
@@ -372,7 +499,8 @@ int main(int argc, char *argv[])
     cout << "Best Recall@10:" << endl;
     cout << "  M=" << best_recall.M
          << ", ef_construction=" << best_recall.ef_construction
-         << ", ef_search=" << best_recall.ef_search << endl;
+         << ", ef_search=" << best_recall.ef_search
+         << ", gamma=" << best_recall.gamma << endl;
     cout << "  Recall@10: " << fixed << setprecision(4) << best_recall.recall_10
          << ", Query time: " << fixed << setprecision(2) << best_recall.avg_search_ms << "ms" << endl
          << endl;
@@ -380,7 +508,8 @@ int main(int argc, char *argv[])
     cout << "Best Query Speed:" << endl;
     cout << "  M=" << best_speed.M
          << ", ef_construction=" << best_speed.ef_construction
-         << ", ef_search=" << best_speed.ef_search << endl;
+         << ", ef_search=" << best_speed.ef_search
+         << ", gamma=" << best_speed.gamma << endl;
     cout << "  Query time: " << fixed << setprecision(2) << best_speed.avg_search_ms << "ms"
          << ", Recall@10: " << fixed << setprecision(4) << best_speed.recall_10 << endl
          << endl;
@@ -388,18 +517,36 @@ int main(int argc, char *argv[])
     cout << "Best Overall Score:" << endl;
     cout << "  M=" << best_score.M
          << ", ef_construction=" << best_score.ef_construction
-         << ", ef_search=" << best_score.ef_search << endl;
+         << ", ef_search=" << best_score.ef_search
+         << ", gamma=" << best_score.gamma << endl;
     cout << "  Score: " << fixed << setprecision(2) << best_score.score
          << ", Recall@10: " << fixed << setprecision(4) << best_score.recall_10
          << ", Query time: " << fixed << setprecision(2) << best_score.avg_search_ms << "ms" << endl
          << endl;
 
-    // Save results to CSV
+    vector<ParamResult> frontier;
+    for (const auto &r : results)
+        if (r.pareto)
+            frontier.push_back(r);
+    sort(frontier.begin(), frontier.end(), [](const ParamResult &a, const ParamResult &b)
+         { return a.recall_10 < b.recall_10; });
+
+    cout << "Pareto frontier (QPS vs Recall@10): " << frontier.size() << " configurations" << endl;
+    for (const auto &r : frontier)
+    {
+        cout << "  M=" << r.M << ", ef_c=" << r.ef_construction << ", ef_s=" << r.ef_search
+             << ", gamma=" << fixed << setprecision(2) << r.gamma
+             << "  R@10=" << fixed << setprecision(4) << r.recall_10
+             << "  QPS=" << fixed << setprecision(0) << r.qps << endl;
+    }
+    cout << endl;
+
+    // Save results to CSV (the first nine columns keep the original layout)
     string csv_filename = "sift_grid_search_results.csv";
     ofstream csv_file(csv_filename);
     if (csv_file.is_open())
     {
-        csv_file << "M,ef_construction,ef_search,build_time_ms,search_time_ms,avg_search_ms,recall_1,recall_10,score" << endl;
+        csv_file << "M,ef_construction,ef_search,build_time_ms,search_time_ms,avg_search_ms,recall_1,recall_10,score,gamma,qps,pareto" << endl;
         for (const auto &r : results)
         {
             csv_file << r.M << ","
@@ -410,12 +557,41 @@ int main(int argc, char *argv[])
                      << fixed << setprecision(4) << r.avg_search_ms << ","
                      << fixed << setprecision(6) << r.recall_1 << ","
                      << fixed << setprecision(6) << r.recall_10 << ","
-                     << fixed << setprecision(4) << r.score << endl;
+                     << fixed << setprecision(4) << r.score << ","
+                     << fixed << setprecision(2) << r.gamma << ","
+                     << fixed << setprecision(1) << r.qps << ","
+                     << (r.pareto ? 1 : 0) << endl;
         }
         csv_file.close();
         cout << "Results saved to: " << csv_filename << endl;
     }
 
+    // Pareto frontier as JSON, ordered by recall
+    string json_filename = "sift_grid_search_pareto.json";
+    ofstream json_file(json_filename);
+    if (json_file.is_open())
+    {
+        json_file << "{\n  \"dataset\": \"" << dataset_dir << "\",\n"
+                  << "  \"queries\": " << queries.size() << ",\n"
+                  << "  \"frontier\": [\n";
+        for (size_t i = 0; i < frontier.size(); ++i)
+        {
+            const auto &r = frontier[i];
+            json_file << "    {\"M\": " << r.M
+                      << ", \"ef_construction\": " << r.ef_construction
+                      << ", \"ef_search\": " << r.ef_search
+                      << ", \"gamma\": " << fixed << setprecision(2) << r.gamma
+                      << ", \"recall_10\": " << fixed << setprecision(6) << r.recall_10
+                      << ", \"qps\": " << fixed << setprecision(1) << r.qps
+                      << ", \"avg_search_ms\": " << fixed << setprecision(4) << r.avg_search_ms
+                      << ", \"build_time_ms\": " << r.build_time_ms << "}"
+                      << (i + 1 < frontier.size() ? "," : "") << "\n";
+        }
+        json_file << "  ]\n}\n";
+        json_file.close();
+        cout << "Pareto frontier saved to: " << json_filename << endl;
+    }
+
     // Save detailed markdown report
     string md_filename = "sift_grid_search_report.md";
     ofstream md_file(md_filename);
@@ -437,21 +613,28 @@ int main(int argc, char *argv[])
         md_file << "\n- ef_search: ";
         for (int ef : ef_search_values)
             md_file << ef << " ";
+        md_file << "\n- gamma: ";
+        for (float g : gamma_values)
+            md_file << g << " ";
+        md_file << "\n- Graphs built: " << total_graphs;
         md_file << "\n- Total combinations: " << total_combinations << "\n\n";
 
         md_file << "## All Results\n\n";
-        md_file << "| M | ef_c | ef_s | Build(s) | Query(ms) | R@1 | R@10 | Score |\n";
-        md_file << "|---|------|------|----------|-----------|-----|------|-------|\n";
+        md_file << "| M | ef_c | ef_s | gamma | Build(s) | Query(ms) | QPS | R@1 | R@10 | Score | Pareto |\n";
+        md_file << "|---|------|------|-------|----------|-----------|-----|-----|------|-------|--------|\n";
         for (const auto &r : results)
         {
             md_file << "| " << r.M
                     << " | " << r.ef_construction
                     << " | " << r.ef_search
+                    << " | " << fixed << setprecision(2) << r.gamma
                     << " | " << fixed << setprecision(2) << (r.build_time_ms / 1000.0)
-                    << " | " << fixed << setprecision(2) << r.avg_search_ms
+                    << " | " << fixed << setprecision(3) << r.avg_search_ms
+                    << " | " << fixed << setprecision(0) << r.qps
                     << " | " << fixed << setprecision(4) << r.recall_1
                     << " | " << fixed << setprecision(4) << r.recall_10
                     << " | " << fixed << setprecision(2) << r.score
+                    << " | " << (r.pareto ? "*" : "")
                     << " |\n";
         }
 
@@ -459,21 +642,24 @@ int main(int argc, char *argv[])
         md_file << "### Best Recall@10\n";
         md_file << "- M=" << best_recall.M
                 << ", ef_construction=" << best_recall.ef_construction
-                << ", ef_search=" << best_recall.ef_search << "\n";
+                << ", ef_search=" << best_recall.ef_search
+                << ", gamma=" << best_recall.gamma << "\n";
         md_file << "- Recall@10: " << fixed << setprecision(4) << best_recall.recall_10 << "\n";
         md_file << "- Query time: " << fixed << setprecision(2) << best_recall.avg_search_ms << "ms\n\n";
 
         md_file << "### Best Query Speed\n";
         md_file << "- M=" << best_speed.M
                 << ", ef_construction=" << best_speed.ef_construction
-                << ", ef_search=" << best_speed.ef_search << "\n";
+                << ", ef_search=" << best_speed.ef_search
+                << ", gamma=" << best_speed.gamma << "\n";
         md_file << "- Query time: " << fixed << setprecision(2) << best_speed.avg_search_ms << "ms\n";
         md_file << "- Recall@10: " << fixed << setprecision(4) << best_speed.recall_10 << "\n\n";
 
         md_file << "### Best Overall Score\n";
         md_file << "- M=" << best_score.M
                 << ", ef_construction=" << best_score.ef_construction
-                << ", ef_search=" << best_score.ef_search << "\n";
+                << ", ef_search=" << best_score.ef_search
+                << ", gamma=" << best_score.gamma << "\n";
         md_file << "- Score: " << fixed << setprecision(2) << best_score.score << "\n";
         md_file << "- Recall@10: " << fixed << setprecision(4) << best_score.recall_10 << "\n";
         md_file << "- Query time: " << fixed << setprecision(2) << best_score.avg_search_ms << "ms\n";
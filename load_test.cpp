@@ -0,0 +1,300 @@
+/*
+ * Open-loop load generator
+ * Issues queries at a target arrival rate (Poisson, or replayed from a trace
+ * of arrival timestamps) against a pool of search threads. Latency is taken
+ * from each query's intended send time, not from when a thread got to it,
+ * so queueing delay is included (no coordinated omission). The rate is
+ * raised step by step until p99 breaks the SLO; the last rate that held is
+ * the capacity of this box.
+ *
+ * Usage: load_test <dataset_dir> [--threads N] [--slo-p99 ms] [--rate qps]
+ *                  [--step 1.25] [--max-steps 20] [--duration s]
+ *                  [--trace arrivals.txt] [--ef-search N] [--cache graph.bin]
+ *                  [--time-budget ms] [--max-hops N] [--out load_test_results.json]
+ *
+ * A trace file holds one arrival time in seconds per line (absolute or
+ * relative to the first line); queries are taken from query.txt in order.
+ * With a trace, --rate scales it (rate / native trace rate) at each step.
+ * --time-budget / --max-hops make every query anytime (SearchParams); the
+ * share of answers cut short is reported per step.
+ */
+
+#include "MySolution.h"
+#include "benchmark_common.h"
+#include <chrono>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <random>
+
+using namespace std;
+typedef chrono::steady_clock Clock;
+
+struct StepResult
+{
+    double offered_qps;
+    double achieved_qps;
+    double mean_ms, p50_ms, p95_ms, p99_ms, p999_ms, max_ms;
+    double recall_10;
+    double truncated; // fraction of queries that hit their budget
+    long long queries;
+    bool meets_slo;
+};
+
+// Arrival offsets in seconds for one step. Poisson: exponential gaps at the
+// given rate. Trace: the trace's own gaps, stretched to the given rate.
+static vector<double> make_schedule(double rate, double duration, const vector<double> &trace, mt19937 &rng)
+{
+    vector<double> at;
+    if (trace.size() >= 2)
+    {
+        double native = (trace.size() - 1) / max(1e-9, trace.back() - trace.front());
+        double scale = native / rate;
+        for (size_t i = 0; i < trace.size(); ++i)
+        {
+            double t = (trace[i] - trace.front()) * scale;
+            if (t > duration)
+                break;
+            at.push_back(t);
+        }
+        return at;
+    }
+
+    exponential_distribution<double> gap(rate);
+    for (double t = gap(rng); t < duration; t += gap(rng))
+        at.push_back(t);
+    return at;
+}
+
+static StepResult run_step(Solution &solution, const SearchParams &params, const vector<float> &queries,
+                           int dimension, int nq, int threads, const vector<double> &schedule, double offered,
+                           const vector<vector<int>> &groundtruth)
+{
+    int n = schedule.size();
+    vector<LatencyHistogram> hist(threads);
+    vector<int> results((long long)nq * 10, -1);
+    atomic<int> next(0);
+    atomic<long long> truncated(0);
+    Clock::time_point start = Clock::now() + chrono::milliseconds(10);
+
+    auto worker = [&](int t)
+    {
+        vector<float> q(dimension);
+        int res[10];
+        for (int i = next++; i < n; i = next++)
+        {
+            Clock::time_point intended = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(schedule[i]));
+            // Sleep most of the way, spin the rest; late queries go immediately
+            Clock::time_point now = Clock::now();
+            if (intended - now > chrono::microseconds(200))
+                this_thread::sleep_until(intended - chrono::microseconds(100));
+            while (Clock::now() < intended)
+                ;
+
+            int qi = i % nq;
+            copy(queries.begin() + (long long)qi * dimension, queries.begin() + (long long)(qi + 1) * dimension, q.begin());
+            if (solution.search(q, params, res))
+                truncated++;
+            Clock::time_point done = Clock::now();
+            hist[t].record(chrono::duration_cast<chrono::nanoseconds>(done - intended).count());
+            if (i < nq)
+                copy(res, res + 10, results.begin() + (long long)qi * 10);
+        }
+    };
+
+    vector<thread> pool;
+    for (int t = 0; t < threads; ++t)
+        pool.push_back(thread(worker, t));
+    for (auto &th : pool)
+        th.join();
+    double elapsed = chrono::duration<double>(Clock::now() - start).count();
+
+    LatencyHistogram all;
+    for (const auto &h : hist)
+        all.merge(h);
+
+    StepResult r;
+    r.offered_qps = offered;
+    r.queries = all.count();
+    r.achieved_qps = elapsed > 0 ? all.count() / elapsed : 0.0;
+    r.mean_ms = all.mean_ms();
+    r.p50_ms = all.percentile_ms(0.50);
+    r.p95_ms = all.percentile_ms(0.95);
+    r.p99_ms = all.percentile_ms(0.99);
+    r.p999_ms = all.percentile_ms(0.999);
+    r.max_ms = all.max_ms();
+    r.recall_10 = recall_at(results, 10, groundtruth, 10);
+    r.truncated = n > 0 ? (double)truncated.load() / n : 0.0;
+    r.meets_slo = false;
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " <dataset_dir> [--threads N] [--slo-p99 ms] [--rate qps] [--step 1.25] "
+             << "[--max-steps 20] [--duration s] [--trace arrivals.txt] [--ef-search N] [--cache graph.bin] "
+             << "[--time-budget ms] [--max-hops N] [--out load_test_results.json]" << endl;
+        return 1;
+    }
+
+    string dataset_dir = argv[1];
+    string out_file = "load_test_results.json";
+    string cache_file, trace_file;
+    int threads = max(1u, thread::hardware_concurrency());
+    int ef_search = -1, max_steps = 20, max_hops = 0;
+    double time_budget_ms = 0.0;
+    double slo_p99_ms = 10.0, rate = -1.0, step = 1.25, duration = 5.0;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            threads = max(1, atoi(argv[++i]));
+        else if (arg == "--slo-p99" && i + 1 < argc)
+            slo_p99_ms = atof(argv[++i]);
+        else if (arg == "--rate" && i + 1 < argc)
+            rate = atof(argv[++i]);
+        else if (arg == "--step" && i + 1 < argc)
+            step = max(1.01, atof(argv[++i]));
+        else if (arg == "--max-steps" && i + 1 < argc)
+            max_steps = atoi(argv[++i]);
+        else if (arg == "--duration" && i + 1 < argc)
+            duration = atof(argv[++i]);
+        else if (arg == "--trace" && i + 1 < argc)
+            trace_file = argv[++i];
+        else if (arg == "--ef-search" && i + 1 < argc)
+            ef_search = atoi(argv[++i]);
+        else if (arg == "--time-budget" && i + 1 < argc)
+            time_budget_ms = atof(argv[++i]);
+        else if (arg == "--max-hops" && i + 1 < argc)
+            max_hops = atoi(argv[++i]);
+        else if (arg == "--cache" && i + 1 < argc)
+            cache_file = argv[++i];
+        else if (arg == "--out" && i + 1 < argc)
+            out_file = argv[++i];
+    }
+
+    int dimension = 0, num_vectors = 0, num_queries = 0;
+    vector<float> queries = load_vectors(dataset_dir + "/query.txt", dimension, num_queries);
+    vector<vector<int>> groundtruth = load_groundtruth(dataset_dir + "/groundtruth.txt");
+    if (queries.empty())
+    {
+        cerr << "Failed to load queries" << endl;
+        return 1;
+    }
+
+    vector<double> trace;
+    if (!trace_file.empty())
+    {
+        ifstream in(trace_file);
+        double t;
+        while (in >> t)
+            trace.push_back(t);
+        if (trace.size() < 2)
+        {
+            cerr << "Trace needs at least two arrival times: " << trace_file << endl;
+            return 1;
+        }
+    }
+
+    Solution solution;
+    if (cache_file.empty() || !solution.load_graph(cache_file))
+    {
+        vector<float> base = load_vectors(dataset_dir + "/base.txt", dimension, num_vectors);
+        if (base.empty())
+        {
+            cerr << "Failed to load base vectors" << endl;
+            return 1;
+        }
+        solution.build(dimension, base);
+        if (!cache_file.empty())
+            solution.save_graph(cache_file);
+    }
+    SearchParams params = solution.default_search_params(10);
+    if (ef_search > 0)
+        params.ef = ef_search;
+    params.time_budget_ms = time_budget_ms;
+    params.max_hops = max_hops;
+
+    // Starting rate: a quarter of the closed-loop single-thread throughput per worker
+    if (rate <= 0)
+    {
+        int res[10];
+        auto t0 = Clock::now();
+        for (int i = 0; i < num_queries; ++i)
+        {
+            vector<float> q(queries.begin() + (long long)i * dimension, queries.begin() + (long long)(i + 1) * dimension);
+            solution.search(q, params, res);
+        }
+        double per_query = chrono::duration<double>(Clock::now() - t0).count() / num_queries;
+        rate = 0.25 * threads / max(1e-9, per_query);
+    }
+
+    cout << "Dataset: " << dataset_dir << " (" << num_queries << " queries), " << threads << " search threads, "
+         << (trace.empty() ? string("Poisson arrivals") : "trace " + trace_file) << endl;
+    cout << "SLO: p99 <= " << slo_p99_ms << " ms, " << duration << " s per step" << endl;
+
+    cout << fixed;
+    cout << setw(10) << "offered" << " | " << setw(10) << "achieved" << " | " << setw(8) << "mean ms" << " | "
+         << setw(8) << "p50" << " | " << setw(8) << "p95" << " | " << setw(8) << "p99" << " | "
+         << setw(8) << "p99.9" << " | " << setw(6) << "R@10" << " | " << setw(6) << "trunc" << " | SLO" << endl;
+
+    mt19937 rng(42);
+    vector<StepResult> steps;
+    double capacity = 0.0;
+    for (int s = 0; s < max_steps; ++s, rate *= step)
+    {
+        vector<double> schedule = make_schedule(rate, duration, trace, rng);
+        if (schedule.empty())
+            continue;
+        StepResult r = run_step(solution, params, queries, dimension, num_queries, threads, schedule, rate, groundtruth);
+        r.meets_slo = r.p99_ms <= slo_p99_ms;
+        steps.push_back(r);
+
+        cout << setw(10) << setprecision(1) << r.offered_qps << " | " << setw(10) << r.achieved_qps << " | "
+             << setw(8) << setprecision(3) << r.mean_ms << " | " << setw(8) << r.p50_ms << " | "
+             << setw(8) << r.p95_ms << " | " << setw(8) << r.p99_ms << " | " << setw(8) << r.p999_ms << " | "
+             << setw(6) << setprecision(4) << r.recall_10 << " | " << setw(6) << r.truncated << " | "
+             << (r.meets_slo ? "ok" : "BREAK") << endl;
+
+        if (!r.meets_slo)
+            break;
+        capacity = r.achieved_qps;
+    }
+
+    if (capacity > 0)
+        cout << "Capacity at p99 <= " << setprecision(2) << slo_p99_ms << " ms: " << setprecision(1) << capacity << " QPS" << endl;
+    else
+        cout << "SLO broken at the lowest rate; lower --rate or relax --slo-p99" << endl;
+
+    ofstream out(out_file);
+    if (!out)
+    {
+        cerr << "Failed to write " << out_file << endl;
+        return 1;
+    }
+    out << setprecision(6);
+    out << "{\n  \"dataset\": \"" << dataset_dir << "\",\n"
+        << "  \"threads\": " << threads << ",\n"
+        << "  \"arrivals\": \"" << (trace.empty() ? "poisson" : "trace") << "\",\n"
+        << "  \"slo_p99_ms\": " << slo_p99_ms << ",\n"
+        << "  \"time_budget_ms\": " << time_budget_ms << ",\n"
+        << "  \"max_hops\": " << max_hops << ",\n"
+        << "  \"capacity_qps\": " << capacity << ",\n"
+        << "  \"steps\": [\n";
+    for (size_t i = 0; i < steps.size(); ++i)
+    {
+        const StepResult &r = steps[i];
+        out << "    {\"offered_qps\": " << r.offered_qps << ", \"achieved_qps\": " << r.achieved_qps
+            << ", \"queries\": " << r.queries << ", \"mean\": " << r.mean_ms << ", \"p50\": " << r.p50_ms
+            << ", \"p95\": " << r.p95_ms << ", \"p99\": " << r.p99_ms << ", \"p999\": " << r.p999_ms
+            << ", \"max\": " << r.max_ms << ", \"recall@10\": " << r.recall_10 << ", \"truncated\": " << r.truncated
+            << ", \"meets_slo\": " << (r.meets_slo ? "true" : "false") << "}"
+            << (i + 1 < steps.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    cout << "Results written to " << out_file << " (latencies in ms)" << endl;
+    return 0;
+}
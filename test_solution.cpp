@@ -208,6 +208,7 @@ int main(int argc, char *argv[])
     bool use_cache = false;
     bool save_cache = false;
     int custom_ef_search = -1;
+    bool build_stats = false;
 
     if (argc > 1)
     {
@@ -231,6 +232,10 @@ int main(int argc, char *argv[])
             custom_ef_search = atoi(argv[i + 1]);
             ++i;
         }
+        else if (arg == "--build-stats")
+        {
+            build_stats = true;
+        }
     }
 
     string base_file = dataset_dir + "/base.txt";
@@ -288,12 +293,26 @@ int main(int argc, char *argv[])
         cout << "Loaded " << num_vectors << " vectors of dimension " << dimension << endl;
 
         // Build index
+        if (build_stats)
+            solution.set_build_progress_callback([](const BuildProgress &p)
+                                                 { cout << "  inserted " << p.inserted << "/" << p.total << " ("
+                                                        << (long long)p.inserts_per_sec << " inserts/s)" << endl; });
         auto build_start = chrono::high_resolution_clock::now();
         solution.build(dimension, base_vectors);
         auto build_end = chrono::high_resolution_clock::now();
         auto build_time = chrono::duration_cast<chrono::milliseconds>(build_end - build_start).count();
 
         cout << "\nBuild time: " << build_time << " ms" << endl;
+        const BuildStats &bs = solution.get_build_stats();
+        if (build_stats && bs.inserts > 0)
+        {
+            cout << "  levels " << bs.level_assignment << " s, descent " << bs.upper_descent
+                 << " s, search " << bs.candidate_search << " s, prune " << bs.pruning
+                 << " s, link " << bs.linking << " s (lock wait " << bs.lock_wait
+                 << " s), flatten " << bs.flatten << " s" << endl;
+            cout << "  " << bs.distance_calls / bs.inserts << " distances/insert, " << bs.lazy_prunes
+                 << " lazy prunes, " << bs.contended_locks << " contended locks" << endl;
+        }
 
         // Save cache if requested
         if (save_cache)
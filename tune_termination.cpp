@@ -0,0 +1,222 @@
+/*
+ * Termination model tuning
+ * Fits the learned layer-0 stop rule (TerminationModel) on one dataset:
+ * traces the first half of the queries with the full fixed-ef search,
+ * regresses log(patience needed) on the entry difficulty features, then
+ * compares recall@10 / latency with and without the model on the rest.
+ *
+ * Usage: tune_termination <dataset_dir> [--ef-search N] [--quantile 0.95]
+ *                         [--out termination_model.txt]
+ */
+
+#include "MySolution.h"
+#include "benchmark_common.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+
+using namespace std;
+
+// Solve the 3x3 system A x = b in place (Gaussian elimination, partial pivoting)
+static bool solve3(double A[3][3], double b[3], double x[3])
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        int p = c;
+        for (int r = c + 1; r < 3; ++r)
+            if (fabs(A[r][c]) > fabs(A[p][c]))
+                p = r;
+        if (fabs(A[p][c]) < 1e-12)
+            return false;
+        swap(A[c], A[p]);
+        swap(b[c], b[p]);
+        for (int r = c + 1; r < 3; ++r)
+        {
+            double f = A[r][c] / A[c][c];
+            for (int j = c; j < 3; ++j)
+                A[r][j] -= f * A[c][j];
+            b[r] -= f * b[c];
+        }
+    }
+    for (int c = 2; c >= 0; --c)
+    {
+        double s = b[c];
+        for (int j = c + 1; j < 3; ++j)
+            s -= A[c][j] * x[j];
+        x[c] = s / A[c][c];
+    }
+    return true;
+}
+
+struct EvalResult
+{
+    double recall_10;
+    double avg_ms;
+    double avg_hops;
+};
+
+static EvalResult evaluate(Solution &solution, const vector<float> &queries, int dimension,
+                           int begin, int end, const vector<int> &gt)
+{
+    EvalResult r = {0.0, 0.0, 0.0};
+    int res[10];
+    long long hits = 0, hops = 0;
+    auto start = chrono::high_resolution_clock::now();
+    for (int i = begin; i < end; ++i)
+    {
+        vector<float> q(queries.begin() + (long long)i * dimension,
+                        queries.begin() + (long long)(i + 1) * dimension);
+        QueryTrace trace;
+        solution.search_trace(q, res, trace);
+        hops += trace.hops;
+        set<int> truth(gt.begin() + (long long)i * 10, gt.begin() + (long long)(i + 1) * 10);
+        for (int j = 0; j < 10; ++j)
+            hits += truth.count(res[j]);
+    }
+    auto stop = chrono::high_resolution_clock::now();
+    int n = max(1, end - begin);
+    r.recall_10 = (double)hits / (10.0 * n);
+    r.avg_ms = chrono::duration<double, milli>(stop - start).count() / n;
+    r.avg_hops = (double)hops / n;
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " <dataset_dir> [--ef-search N] [--quantile 0.95] [--out file]" << endl;
+        return 1;
+    }
+
+    string dataset_dir = argv[1];
+    string out_file = "termination_model.txt";
+    int ef_search = -1;
+    double quantile = 0.95;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--ef-search" && i + 1 < argc)
+            ef_search = atoi(argv[++i]);
+        else if (arg == "--quantile" && i + 1 < argc)
+            quantile = atof(argv[++i]);
+        else if (arg == "--out" && i + 1 < argc)
+            out_file = argv[++i];
+    }
+
+    int dimension = 0, num_vectors = 0, num_queries = 0;
+    vector<float> base = load_vectors(dataset_dir + "/base.txt", dimension, num_vectors);
+    vector<float> queries = load_vectors(dataset_dir + "/query.txt", dimension, num_queries);
+    if (base.empty() || num_queries < 4)
+    {
+        cerr << "Failed to load dataset" << endl;
+        return 1;
+    }
+    cout << num_vectors << " base vectors, " << num_queries << " queries, " << dimension << "D" << endl;
+
+    Solution solution;
+    solution.set_index_type(INDEX_HNSW);
+    solution.build(dimension, base);
+    if (ef_search > 0)
+        solution.set_ef_search(ef_search);
+
+    vector<int> gt;
+    solution.search_exact(queries, 10, gt);
+
+    // 1. Trace the training half with the full search
+    int n_train = num_queries / 2;
+    vector<QueryTrace> traces(n_train);
+    int res[10];
+    for (int i = 0; i < n_train; ++i)
+    {
+        vector<float> q(queries.begin() + (long long)i * dimension,
+                        queries.begin() + (long long)(i + 1) * dimension);
+        solution.search_trace(q, res, traces[i]);
+    }
+
+    // 2. Least squares: log(max_gap + 1) ~ w0 + w1 * lid + w2 * gain
+    double A[3][3] = {{0}}, b[3] = {0}, w[3] = {0};
+    for (const QueryTrace &t : traces)
+    {
+        double x[3] = {1.0, t.lid, t.gain};
+        double y = log(t.max_gap + 1.0);
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+                A[r][c] += x[r] * x[c];
+            b[r] += x[r] * y;
+        }
+    }
+    for (int r = 0; r < 3; ++r)
+        A[r][r] += 1e-6; // ridge: keeps degenerate features (e.g. IP lid = 0) solvable
+    if (!solve3(A, b, w))
+    {
+        cerr << "Feature matrix is singular" << endl;
+        return 1;
+    }
+
+    // Shift the intercept so `quantile` of training queries keep their full patience
+    vector<double> residuals;
+    for (const QueryTrace &t : traces)
+        residuals.push_back(log(t.max_gap + 1.0) - (w[0] + w[1] * t.lid + w[2] * t.gain));
+    sort(residuals.begin(), residuals.end());
+    int qi = min((int)residuals.size() - 1, (int)(quantile * residuals.size()));
+    w[0] += residuals[qi];
+
+    TerminationModel model;
+    model.w[0] = (float)w[0];
+    model.w[1] = (float)w[1];
+    model.w[2] = (float)w[2];
+    model.enabled = true;
+
+    // 3. Compare on the held-out half, against the full search and against
+    //    the smallest fixed ef that reaches the same recall
+    EvalResult before = evaluate(solution, queries, dimension, n_train, num_queries, gt);
+    solution.set_termination_model(model);
+    EvalResult after = evaluate(solution, queries, dimension, n_train, num_queries, gt);
+    solution.set_termination_model(TerminationModel());
+
+    int full_ef = solution.get_ef_search();
+    int matched_ef = full_ef;
+    EvalResult matched = before;
+    for (int ef = 10; ef < full_ef; ef += 10)
+    {
+        solution.set_ef_search(ef);
+        EvalResult r = evaluate(solution, queries, dimension, n_train, num_queries, gt);
+        if (r.recall_10 >= after.recall_10)
+        {
+            matched_ef = ef;
+            matched = r;
+            break;
+        }
+    }
+    solution.set_ef_search(full_ef);
+
+    cout << fixed << setprecision(4);
+    cout << "Model: w = [" << model.w[0] << ", " << model.w[1] << ", " << model.w[2]
+         << "], warmup " << model.warmup << ", min_patience " << model.min_patience << endl;
+    cout << "Fixed ef:  recall@10 " << before.recall_10 << ", " << before.avg_ms << " ms/query, "
+         << before.avg_hops << " hops" << endl;
+    cout << "Fixed ef=" << matched_ef << ": recall@10 " << matched.recall_10 << ", " << matched.avg_ms
+         << " ms/query, " << matched.avg_hops << " hops" << endl;
+    cout << "Learned:   recall@10 " << after.recall_10 << ", " << after.avg_ms << " ms/query, "
+         << after.avg_hops << " hops" << endl;
+
+    ofstream out(out_file);
+    if (!out)
+    {
+        cerr << "Failed to write " << out_file << endl;
+        return 1;
+    }
+    out << setprecision(6) << model.w[0] << " " << model.w[1] << " " << model.w[2] << " "
+        << model.warmup << " " << model.min_patience << endl;
+    cout << "Wrote " << out_file << " (load with Solution::load_termination_model)" << endl;
+    return 0;
+}
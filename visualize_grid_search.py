@@ -23,7 +23,11 @@ def load_results(filename='sift_grid_search_results.csv'):
                     'build_time_ms': float(row['build_time_ms']),
                     'avg_search_ms': float(row['avg_search_ms']),
                     'recall_10': float(row['recall_10']),
-                    'score': float(row['score'])
+                    'score': float(row['score']),
+                    # Columns added with the graph-reusing sweep; older CSVs lack them
+                    'gamma': float(row.get('gamma') or 0.0),
+                    'qps': float(row.get('qps') or 0.0) or 1000.0 / max(float(row['avg_search_ms']), 1e-9),
+                    'pareto': row.get('pareto')
                 })
         print(f"Loaded {len(results)} configurations from {filename}")
         return results
@@ -87,31 +91,53 @@ def analyze_parameter_impact(results):
         avg_build = sum(c['build_time_ms'] for c in configs) / len(configs) / 1000
         print(f"{ef_s:>5} | {avg_recall:>10.4f} | {avg_query:>10.2f} | {avg_build:>10.1f} | {len(configs):>6}")
 
+    # Analyze gamma impact
+    by_gamma = defaultdict(list)
+    for r in results:
+        by_gamma[r['gamma']].append(r)
+    if len(by_gamma) > 1:
+        print("\nImpact of gamma (averaged over other parameters):")
+        print("-" * 70)
+        print(f"{'gamma':>5} | {'Recall@10':>10} | {'Query(ms)':>10} | {'QPS':>10} | {'Count':>6}")
+        print("-" * 70)
+        for g in sorted(by_gamma.keys()):
+            configs = by_gamma[g]
+            avg_recall = sum(c['recall_10'] for c in configs) / len(configs)
+            avg_query = sum(c['avg_search_ms'] for c in configs) / len(configs)
+            avg_qps = sum(c['qps'] for c in configs) / len(configs)
+            print(f"{g:>5.2f} | {avg_recall:>10.4f} | {avg_query:>10.2f} | {avg_qps:>10.0f} | {len(configs):>6}")
+
 def find_pareto_optimal(results):
     """Find Pareto optimal configurations (recall vs speed trade-off)"""
     print("\n" + "="*70)
     print("Pareto Optimal Configurations (Recall vs Query Speed)")
     print("="*70)
     
-    # Sort by recall descending
-    sorted_by_recall = sorted(results, key=lambda x: x['recall_10'], reverse=True)
-    
-    pareto = []
-    best_speed = float('inf')
-    
-    for config in sorted_by_recall:
-        if config['avg_search_ms'] < best_speed:
-            pareto.append(config)
-            best_speed = config['avg_search_ms']
+    # Use the frontier marked by grid_search_sift when present
+    if all(r['pareto'] is not None for r in results):
+        pareto = sorted((r for r in results if r['pareto'] == '1'),
+                        key=lambda x: x['recall_10'], reverse=True)
+    else:
+        # Sort by recall descending
+        sorted_by_recall = sorted(results, key=lambda x: x['recall_10'], reverse=True)
+
+        pareto = []
+        best_qps = -1.0
+
+        for config in sorted_by_recall:
+            if config['qps'] > best_qps:
+                pareto.append(config)
+                best_qps = config['qps']
     
     print(f"\nFound {len(pareto)} Pareto optimal configurations:")
-    print("-" * 70)
-    print(f"{'M':>3} | {'ef_c':>5} | {'ef_s':>5} | {'Recall@10':>10} | {'Query(ms)':>10} | {'Score':>8}")
-    print("-" * 70)
+    print("-" * 78)
+    print(f"{'M':>3} | {'ef_c':>5} | {'ef_s':>5} | {'gamma':>5} | {'Recall@10':>10} | {'QPS':>8} | {'Query(ms)':>10}")
+    print("-" * 78)
     
     for config in pareto:
         print(f"{config['M']:>3} | {config['ef_construction']:>5} | {config['ef_search']:>5} | "
-              f"{config['recall_10']:>10.4f} | {config['avg_search_ms']:>10.2f} | {config['score']:>8.2f}")
+              f"{config['gamma']:>5.2f} | {config['recall_10']:>10.4f} | {config['qps']:>8.0f} | "
+              f"{config['avg_search_ms']:>10.3f}")
 
 def generate_html_report(results, filename='sift_grid_search_report.html'):
     """Generate an HTML report with interactive table"""
@@ -175,7 +201,7 @@ def generate_html_report(results, filename='sift_grid_search_report.html'):
     
     # Add table
     html += '<table id="resultsTable">\n<tr>\n'
-    headers = ['M', 'ef_construction', 'ef_search', 'Build Time (s)', 'Query Time (ms)', 'Recall@10', 'Score']
+    headers = ['M', 'ef_construction', 'ef_search', 'gamma', 'Build Time (s)', 'Query Time (ms)', 'QPS', 'Recall@10', 'Score']
     for i, header in enumerate(headers):
         html += f'<th onclick="sortTable({i})">{header}</th>\n'
     html += '</tr>\n'
@@ -191,8 +217,10 @@ def generate_html_report(results, filename='sift_grid_search_report.html'):
         html += f'<td>{r["M"]}</td>\n'
         html += f'<td>{r["ef_construction"]}</td>\n'
         html += f'<td>{r["ef_search"]}</td>\n'
+        html += f'<td>{r["gamma"]:.2f}</td>\n'
         html += f'<td>{r["build_time_ms"]/1000:.1f}</td>\n'
         html += f'<td>{r["avg_search_ms"]:.2f}</td>\n'
+        html += f'<td>{r["qps"]:.0f}</td>\n'
         html += f'<td>{r["recall_10"]:.4f}</td>\n'
         html += f'<td>{r["score"]:.2f}</td>\n'
         html += '</tr>\n'